@@ -0,0 +1,36 @@
+# rake bench:compare[old.json,new.json]
+#
+# Prints the p50 and p99 creation latency of each case of two runs of
+# bench/namespaces.rb side by side, with the change in percent.
+
+require "json"
+
+abort "usage: #{$0} old.json new.json" unless ARGV.size == 2
+
+old, new = ARGV.map { |f| JSON.parse(File.read(f)) }
+
+def index(report)
+  report["results"].to_h { |r| [[r["case"], r["path"]], r] }
+end
+
+def delta(a, b)
+  return "" unless a && b && a > 0
+
+  format("%+.1f%%", (b - a) * 100.0 / a)
+end
+
+puts "old: #{old["commit"]} #{old["kernel"]}"
+puts "new: #{new["commit"]} #{new["kernel"]}"
+puts format("%-20s %-6s %10s %10s %8s %10s %10s %8s", "case", "path",
+            "old p50", "new p50", "", "old p99", "new p99", "")
+
+olds = index(old)
+index(new).each do |key, r|
+  a = olds.dig(key, "latency_us")
+  b = r["latency_us"]
+  next unless a || b
+
+  puts format("%-20s %-6s %10s %10s %8s %10s %10s %8s", *key,
+              a&.fetch("p50"), b&.fetch("p50"), delta(a&.fetch("p50"), b&.fetch("p50")),
+              a&.fetch("p99"), b&.fetch("p99"), delta(a&.fetch("p99"), b&.fetch("p99")))
+end
@@ -0,0 +1,184 @@
+# rake bench [N=200] [OUT=bench_output.json] [ROOTFS=/path/to/rootfs]
+#
+# Latency of sandbox creation per namespace type and for combinations
+# of them, on the spawn path (CLONE_VM, no fork of ruby) and the fork
+# path (unshare with :fork). Every case runs in a fresh fork of this
+# script; the fork path unshares the calling process itself and a pid
+# namespace can be unshared once per process, so there every sample
+# gets a fresh fork. The results go to a JSON file, compare two of
+# them with
+#
+#   rake bench:compare[old.json,new.json]
+#
+# Without root every case runs in a new user namespace mapped to root.
+# mount_proc needs a pid namespace of that user namespace then, so the
+# cases with it get one. The kernel refuses to unshare a user namespace
+# in a multithreaded process such as ruby, so the fork path of those
+# cases is reported as skipped.
+
+require "etc"
+require "json"
+require "runshare"
+
+N = (ENV["N"] || 200).to_i
+WARMUP = [N / 10, 5].max
+OUT = ENV["OUT"] || "bench_output.json"
+ROOTFS = ENV["ROOTFS"] || "/"
+CMD = ["/bin/true"].freeze
+ROOT = Process.euid.zero?
+
+CASES = {
+  "baseline" => {},
+  "pid" => { clone_newpid: true },
+  "net" => { clone_newnet: true },
+  "ns+mount_proc" => { clone_newns: true, mount_proc: "/proc" },
+  "root" => { root: ROOTFS },
+  "map_root_user" => { map_root_user: true },
+  "keep_caps" => { map_root_user: true, keep_caps: true },
+  "pid+ns+mount_proc" => { clone_newpid: true, clone_newns: true, mount_proc: "/proc" },
+  "pid+net+ns" => { clone_newpid: true, clone_newnet: true, clone_newns: true },
+  "all" => { clone_newpid: true, clone_newnet: true, clone_newns: true, mount_proc: "/proc",
+             root: ROOTFS, map_root_user: true, keep_caps: true },
+}.freeze
+
+def options(opts)
+  opts = opts.merge(timings: true)
+  return opts if ROOT
+
+  opts = opts.merge(clone_newuser: true, map_root_user: true)
+  opts[:clone_newpid] = true if opts[:mount_proc]
+  opts
+end
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+# seconds of one sandbox creation, and its phase timings
+def create(path, opts)
+  if path == :spawn
+    t = now
+    child = RUnshare.spawn(CMD, **opts)
+    t = now - t
+  else
+    t = now
+    child = RUnshare.unshare(**opts, fork: true)
+    exit!(0) if child == 0
+    t = now - t
+  end
+
+  status = child.wait
+  raise "sandbox failed: #{status.inspect}" unless status.success?
+
+  [t, child.timings]
+end
+
+def percentile(sorted, p)
+  sorted[((sorted.size - 1) * p).round]
+end
+
+def stats(samples)
+  us = samples.map { |s| s * 1e6 }.sort
+  {
+    "min" => us.first.round(1),
+    "p50" => percentile(us, 0.5).round(1),
+    "p90" => percentile(us, 0.9).round(1),
+    "p99" => percentile(us, 0.99).round(1),
+    "max" => us.last.round(1),
+    "mean" => (us.sum / us.size).round(1),
+  }
+end
+
+# runs the block in a child and returns its result, nil if it died
+def isolated
+  r, w = IO.pipe
+  pid = fork do
+    r.close
+    result = begin
+      yield
+    rescue StandardError, NotImplementedError => e
+      { "error" => "#{e.class}: #{e.message}" }
+    end
+    w.write(JSON.generate(result))
+    w.close
+    exit!(0)
+  end
+  w.close
+  out = r.read
+  r.close
+  Process.wait(pid)
+
+  out.empty? ? nil : JSON.parse(out)
+end
+
+def sample(path, opts)
+  return create(path, opts) if path == :spawn
+
+  t, timings = isolated { create(path, opts) }
+  raise "sample runner died" if t.nil?
+  raise t["error"] if t.is_a?(Hash)
+
+  [t, timings]
+end
+
+def measure(path, opts)
+  WARMUP.times { sample(path, opts) }
+
+  samples = []
+  phases = Hash.new { |h, k| h[k] = [] }
+  N.times do
+    t, timings = sample(path, opts)
+    samples << t
+    timings.each { |phase, s| phases[phase.to_s] << s }
+  end
+
+  {
+    "n" => N,
+    "latency_us" => stats(samples),
+    "phases_p50_us" => phases.to_h { |phase, s| [phase, stats(s)["p50"]] },
+  }
+end
+
+# runs the case in a child, so its namespaces never leak into the next one
+def run_case(path, opts)
+  if path == :fork && (opts[:clone_newuser] || opts[:map_root_user])
+    return { "skipped" => "no user namespaces in a multithreaded process" }
+  end
+
+  isolated { measure(path, opts) } || { "error" => "runner died" }
+end
+
+def git_commit
+  `git rev-parse HEAD 2>/dev/null`.strip
+end
+
+results = []
+CASES.each do |name, opts|
+  opts = options(opts)
+
+  [:spawn, :fork].each do |path|
+    result = run_case(path, opts)
+    results << { "case" => name, "path" => path.to_s,
+                 "options" => opts.reject { |k, _| k == :timings } }.merge(result)
+
+    line = result["latency_us"] ? result["latency_us"].map { |k, v| "#{k}=#{v}" }.join(" ") :
+                                  result["skipped"] || result["error"]
+    puts format("%-20s %-6s %s", name, path, line)
+  end
+end
+
+report = {
+  "commit" => git_commit,
+  "time" => Time.now.utc.strftime("%FT%TZ"),
+  "ruby" => RUBY_DESCRIPTION,
+  "kernel" => Etc.uname[:release],
+  "cpus" => Etc.nprocessors,
+  "root" => ROOT,
+  "userns_fallback" => !ROOT,
+  "rootfs" => ROOTFS,
+  "features" => RUnshare.features.reject { |k, _| k == :paths },
+  "results" => results,
+}
+
+File.write(OUT, JSON.pretty_generate(report) + "\n")
+puts "written to #{OUT}"
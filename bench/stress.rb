@@ -0,0 +1,268 @@
+# rake bench:stress [MODE=both] [MAX_CONCURRENCY=512] [DURATION=2] [LIVE=10000]
+#                   [LIVE_STEP=500] [OUT=stress_output.json]
+#
+# Finds where sandbox creation stops scaling on this box, in two runs:
+#
+#   concurrency  1, 2, 4, .. MAX_CONCURRENCY threads create and reap
+#                sandboxes for DURATION seconds per level
+#   live         sandboxes are started and kept running up to LIVE of
+#                them, measured every LIVE_STEP
+#
+# Every step records the creation throughput, latency percentiles and
+# errors by step and errno, next to samples of /proc/sys/user/*
+# (the max_*_namespaces limits), the namespaces alive on the box and
+# the net_namespace slab. Namespaces in the slab that no process has
+# any more are waiting for cleanup_net. The report names the level where
+# throughput stopped growing, latency took off or errors began.
+#
+# Without root the sandboxes get a user namespace mapped to root. The
+# live run raises RLIMIT_NOFILE to the hard limit, every child holds a
+# pidfd.
+
+require "etc"
+require "json"
+require "runshare"
+
+MODE = ENV["MODE"] || "both"
+MAX_CONCURRENCY = (ENV["MAX_CONCURRENCY"] || 512).to_i
+DURATION = (ENV["DURATION"] || 2).to_f
+LIVE = (ENV["LIVE"] || 10_000).to_i
+LIVE_STEP = (ENV["LIVE_STEP"] || 500).to_i
+LIVE_THREADS = 16
+OUT = ENV["OUT"] || "stress_output.json"
+ROOT = Process.euid.zero?
+
+OPTS = begin
+  opts = { clone_newpid: true, clone_newnet: true, clone_newipc: true,
+           clone_newuts: true, clone_newns: true }
+  opts.merge!(clone_newuser: true, map_root_user: true) unless ROOT
+  opts.freeze
+end
+
+NS_TYPES = %w[user pid net ipc uts mnt cgroup time].freeze
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def percentile(sorted, p)
+  sorted.empty? ? nil : sorted[((sorted.size - 1) * p).round]
+end
+
+def latency(samples)
+  us = samples.map { |s| (s * 1e6).round(1) }.sort
+  { "p50" => percentile(us, 0.5), "p90" => percentile(us, 0.9),
+    "p99" => percentile(us, 0.99), "max" => us.last }
+end
+
+def error_key(e)
+  err = e.respond_to?(:errno) ? SystemCallError.new(nil, e.errno).class.name.sub("Errno::", "") : e.class.name
+  e.respond_to?(:step) ? "#{e.step}: #{err}" : "#{err}: #{e.message}"
+end
+
+# /proc/sys/user/max_*_namespaces and friends
+def user_limits
+  Dir["/proc/sys/user/*"].sort.to_h { |f| [File.basename(f), File.read(f).to_i] }
+rescue SystemCallError
+  {}
+end
+
+# distinct namespaces of each type held by a process
+def namespace_counts
+  seen = NS_TYPES.to_h { |t| [t, {}] }
+  Dir.each_child("/proc") do |pid|
+    next unless pid.match?(/\A\d+\z/)
+
+    NS_TYPES.each do |t|
+      seen[t][File.readlink("/proc/#{pid}/ns/#{t}")] = true
+    rescue SystemCallError
+      next
+    end
+  end
+  seen.transform_values(&:size)
+end
+
+# network namespaces allocated by the kernel, alive or not yet cleaned up
+def netns_slab
+  File.foreach("/proc/slabinfo") do |l|
+    return l.split[1].to_i if l.start_with?("net_namespace ")
+  end
+  nil
+rescue SystemCallError
+  nil
+end
+
+def sample_system
+  ns = namespace_counts
+  slab = netns_slab
+  {
+    "user_limits" => user_limits,
+    "namespaces" => ns,
+    "netns_slab" => slab,
+    "netns_dying" => slab && [slab - ns["net"], 0].max,
+  }
+end
+
+def create
+  t = now
+  child = RUnshare.spawn(["/bin/true"], **OPTS)
+  [child, now - t]
+end
+
+# threads creating and reaping sandboxes for DURATION seconds
+def concurrency_level(threads)
+  deadline = now + DURATION
+  lock = Mutex.new
+  samples = []
+  errors = Hash.new(0)
+
+  workers = Array.new(threads) do
+    Thread.new do
+      mine = []
+      while now < deadline
+        begin
+          child, t = create
+          mine << t
+          child.wait
+        rescue SystemCallError => e
+          lock.synchronize { errors[error_key(e)] += 1 }
+        end
+      end
+      lock.synchronize { samples.concat(mine) }
+    end
+  end
+  workers.each(&:join)
+
+  { "concurrency" => threads, "created" => samples.size,
+    "per_second" => (samples.size / DURATION).round(1),
+    "latency_us" => latency(samples), "errors" => errors,
+    "system" => sample_system }
+end
+
+def concurrency_run
+  levels = []
+  c = 1
+  while c <= MAX_CONCURRENCY
+    levels << c
+    c *= 2
+  end
+  levels << MAX_CONCURRENCY unless levels.last == MAX_CONCURRENCY
+
+  levels.map do |n|
+    r = concurrency_level(n)
+    puts format("concurrency %4d: %8.1f/s p50=%sus p99=%sus errors=%d netns_dying=%s",
+                n, r["per_second"], r["latency_us"]["p50"], r["latency_us"]["p99"],
+                r["errors"].values.sum, r["system"]["netns_dying"].inspect)
+    r
+  end
+end
+
+def raise_nofile
+  _, hard = Process.getrlimit(:NOFILE)
+  Process.setrlimit(:NOFILE, hard)
+  hard
+end
+
+# starts sandboxes that stay alive, LIVE_STEP at a time
+def live_run
+  nofile = raise_nofile
+  live = []
+  steps = []
+
+  begin
+    while live.size < LIVE
+      lock = Mutex.new
+      samples = []
+      errors = Hash.new(0)
+      batch = [LIVE_STEP, LIVE - live.size].min
+      left = batch
+      t = now
+
+      workers = Array.new(LIVE_THREADS) do
+        Thread.new do
+          while lock.synchronize { (left -= 1) >= 0 }
+            begin
+              s = now
+              child = RUnshare.spawn(["/bin/sleep", "infinity"], **OPTS)
+              s = now - s
+              lock.synchronize { live << child; samples << s }
+            rescue SystemCallError => e
+              lock.synchronize { errors[error_key(e)] += 1 }
+            end
+          end
+        end
+      end
+      workers.each(&:join)
+      t = now - t
+
+      step = { "live" => live.size, "created" => samples.size,
+               "per_second" => (samples.size / t).round(1),
+               "latency_us" => latency(samples), "errors" => errors,
+               "system" => sample_system }
+      steps << step
+      puts format("live %6d: %8.1f/s p50=%sus p99=%sus errors=%d",
+                  live.size, step["per_second"], step["latency_us"]["p50"],
+                  step["latency_us"]["p99"], errors.values.sum)
+
+      # a limit was hit, more of the same tells nothing new
+      break if errors.values.sum * 2 > batch
+    end
+  ensure
+    live.each { |c| c.kill(:KILL) rescue nil }
+    live.each { |c| c.wait rescue nil }
+  end
+
+  { "nofile" => nofile, "steps" => steps }
+end
+
+# the first step where throughput stopped growing, latency or errors took off
+def knee(steps, key)
+  base = steps.first
+  return nil unless base
+
+  prev = base
+  steps.drop(1).each do |s|
+    reasons = []
+    reasons << "errors: #{s["errors"].keys.join(", ")}" if s["errors"].any?
+    reasons << "throughput fell" if s["per_second"] < prev["per_second"] * 0.9
+    if s["latency_us"]["p99"] && base["latency_us"]["p99"] &&
+       s["latency_us"]["p99"] > base["latency_us"]["p99"] * 10
+      reasons << "p99 over 10x of #{key} #{base[key]}"
+    end
+    return { key => s[key], "reasons" => reasons } if reasons.any?
+
+    prev = s
+  end
+  nil
+end
+
+report = {
+  "commit" => `git rev-parse HEAD 2>/dev/null`.strip,
+  "time" => Time.now.utc.strftime("%FT%TZ"),
+  "kernel" => Etc.uname[:release],
+  "cpus" => Etc.nprocessors,
+  "root" => ROOT,
+  "options" => OPTS,
+  "before" => sample_system,
+}
+
+if %w[both concurrency].include?(MODE)
+  report["concurrency"] = concurrency_run
+  report["concurrency_knee"] = knee(report["concurrency"], "concurrency")
+end
+if %w[both live].include?(MODE)
+  report["live"] = live_run
+  report["live_knee"] = knee(report["live"]["steps"], "live")
+end
+report["after"] = sample_system
+report["metrics"] = RUnshare.metrics.slice(:failed, :live_children).transform_keys(&:to_s)
+report["metrics"]["failed"] = report["metrics"]["failed"].map { |(step, err), n| [step, err, n] }
+
+File.write(OUT, JSON.pretty_generate(report) + "\n")
+
+%w[concurrency_knee live_knee].each do |k|
+  next unless report.key?(k)
+
+  puts "#{k}: #{report[k] ? report[k].inspect : "none found"}"
+end
+puts "written to #{OUT}"
@@ -24,10 +24,24 @@ end
 if have_func("setns", "sys/syscall.h")
     $defs.push("-DHAVE_SETNS")
 end
+if have_header("sys/pidfd.h")
+    $defs.push("-DHAVE_SYS_PIDFD_H")
+end
+if have_func("pidfd_open", "sys/pidfd.h")
+    $defs.push("-DHAVE_PIDFD_OPEN")
+end
+if have_func("pidfd_send_signal", "sys/pidfd.h")
+    $defs.push("-DHAVE_PIDFD_SEND_SIGNAL")
+end
 if have_func("err", "err.h")
     $defs.push("-DHAVE_ERR_H")
 end
+# USDT probes, see probes.h (systemtap-sdt-dev / systemtap-sdt-devel)
+if have_header("sys/sdt.h")
+    $defs.push("-DHAVE_SYS_SDT_H")
+end
 
-$srcs = ["runshare.c", "unshare.c"]
+$srcs = ["runshare.c", "unshare.c", "zygote.c", "netns.c", "sync.c", "idcache.c", "kfeatures.c",
+         "metrics.c"]
 
 create_makefile("runshare/runshare")
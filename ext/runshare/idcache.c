@@ -0,0 +1,221 @@
+/*
+ * User and group name resolution for map_user and map_group. With NSS
+ * backed by sssd or LDAP every getpwnam() may be a network round trip,
+ * so resolved names are kept for a TTL and the lookups themselves run
+ * without the GVL. Numeric ids never reach NSS. Failed lookups are not
+ * cached, a user added meanwhile is found on the next call.
+ *
+ * Ractors look names up in parallel, so the tables are fixed arrays
+ * under a mutex that never allocate.
+ */
+
+#include <errno.h>
+#include <grp.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <ruby.h>
+#include <ruby/thread.h>
+
+#include "include/pwdutils.h"
+
+#include "idcache.h"
+
+/* names remembered per table, the one expiring first makes room */
+#define IDCACHE_SIZE		64
+#define IDCACHE_NAME_MAX	64
+
+struct idcache_entry {
+    char name[IDCACHE_NAME_MAX];	/* empty when unused */
+    unsigned long id;
+    long long expires;
+};
+
+struct idcache_lookup {
+    const char *name;
+    unsigned long id;
+    int found;
+};
+
+static pthread_mutex_t idcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct idcache_entry users[IDCACHE_SIZE];
+static struct idcache_entry groups[IDCACHE_SIZE];
+static long ttl_ms = IDCACHE_TTL_MS;
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* a plain decimal id, as accepted by unshare(1) next to names */
+static int parse_id(const char *s, unsigned long *id)
+{
+    unsigned long v = 0;
+    const char *p;
+
+    if (!*s)
+        return -1;
+    for (p = s; *p; p++) {
+        if (*p < '0' || *p > '9')
+            return -1;
+        v = v * 10 + (*p - '0');
+        /* (uid_t) -1 means no mapping */
+        if (v >= (uid_t) -1)
+            return -1;
+    }
+
+    *id = v;
+    return 0;
+}
+
+static void *lookup_user(void *ptr)
+{
+    struct idcache_lookup *l = ptr;
+    struct passwd *pw;
+    char *buf = NULL;
+
+    pw = xgetpwnam(l->name, &buf);
+    if (pw) {
+        l->id = pw->pw_uid;
+        l->found = 1;
+        free(pw);
+        free(buf);
+    }
+
+    return NULL;
+}
+
+static void *lookup_group(void *ptr)
+{
+    struct idcache_lookup *l = ptr;
+    struct group *gr;
+    char *buf = NULL;
+
+    gr = xgetgrnam(l->name, &buf);
+    if (gr) {
+        l->id = gr->gr_gid;
+        l->found = 1;
+        free(gr);
+        free(buf);
+    }
+
+    return NULL;
+}
+
+/* called with idcache_lock held */
+static int cache_get(struct idcache_entry *table, const char *name, unsigned long *id)
+{
+    int i;
+
+    for (i = 0; i < IDCACHE_SIZE; i++) {
+        if (strcmp(table[i].name, name) == 0 && now_ms() < table[i].expires) {
+            *id = table[i].id;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* called with idcache_lock held */
+static void cache_put(struct idcache_entry *table, const char *name, unsigned long id)
+{
+    struct idcache_entry *e = &table[0];
+    int i;
+
+    for (i = 0; i < IDCACHE_SIZE; i++) {
+        if (strcmp(table[i].name, name) == 0) {
+            e = &table[i];
+            break;
+        }
+        if (table[i].expires < e->expires)
+            e = &table[i];
+    }
+
+    strcpy(e->name, name);
+    e->id = id;
+    e->expires = now_ms() + ttl_ms;
+}
+
+static int resolve(struct idcache_entry *table, void *(*lookup)(void *),
+                   const char *name, unsigned long *id)
+{
+    struct idcache_lookup l = { .name = name };
+    int rc;
+
+    if (parse_id(name, id) == 0)
+        return 0;
+
+    /* longer names are rare enough to always ask NSS */
+    if (strlen(name) < IDCACHE_NAME_MAX) {
+        pthread_mutex_lock(&idcache_lock);
+        rc = cache_get(table, name, id);
+        pthread_mutex_unlock(&idcache_lock);
+        if (rc == 0)
+            return 0;
+    }
+
+    /* a slow directory must not stall the other threads */
+    rb_thread_call_without_gvl(lookup, &l, NULL, NULL);
+    if (!l.found)
+        return -1;
+
+    *id = l.id;
+    if (ttl_ms > 0 && strlen(name) < IDCACHE_NAME_MAX) {
+        pthread_mutex_lock(&idcache_lock);
+        cache_put(table, name, l.id);
+        pthread_mutex_unlock(&idcache_lock);
+    }
+
+    return 0;
+}
+
+long rb_idcache_ttl(void)
+{
+    return ttl_ms;
+}
+
+/* 0 turns the cache off, every name goes to NSS again */
+void rb_idcache_set_ttl(long ms)
+{
+    ttl_ms = ms;
+    if (ms == 0)
+        rb_idcache_clear();
+}
+
+void rb_idcache_clear(void)
+{
+    pthread_mutex_lock(&idcache_lock);
+    memset(users, 0, sizeof(users));
+    memset(groups, 0, sizeof(groups));
+    pthread_mutex_unlock(&idcache_lock);
+}
+
+/* returns 0 with *uid set, -1 if name is neither an id nor a known user */
+int rb_idcache_user(const char *name, uid_t *uid)
+{
+    unsigned long id;
+
+    if (resolve(users, lookup_user, name, &id) < 0)
+        return -1;
+
+    *uid = id;
+    return 0;
+}
+
+int rb_idcache_group(const char *name, gid_t *gid)
+{
+    unsigned long id;
+
+    if (resolve(groups, lookup_group, name, &id) < 0)
+        return -1;
+
+    *gid = id;
+    return 0;
+}
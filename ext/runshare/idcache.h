@@ -0,0 +1,15 @@
+#ifndef IDCACHE_H
+#define IDCACHE_H 1
+
+#include <sys/types.h>
+
+/* how long a resolved user or group name is trusted by default */
+#define IDCACHE_TTL_MS		60000
+
+long rb_idcache_ttl(void);
+void rb_idcache_set_ttl(long ttl_ms);
+void rb_idcache_clear(void);
+int rb_idcache_user(const char *name, uid_t *uid);
+int rb_idcache_group(const char *name, gid_t *gid);
+
+#endif
@@ -0,0 +1,43 @@
+/*
+ * No copyright is claimed.  This code is in the public domain; do with
+ * it what you wish.
+ *
+ * Compat code so pidfd syscalls can be used with older libcs
+ */
+#ifndef UTIL_LINUX_PIDFD_UTILS
+#define UTIL_LINUX_PIDFD_UTILS
+
+#if defined(__linux__)
+# include <sys/syscall.h>
+# include <sys/types.h>
+# include <signal.h>
+# ifdef HAVE_SYS_PIDFD_H
+#  include <sys/pidfd.h>
+# endif
+
+# ifndef SYS_pidfd_send_signal
+#  define SYS_pidfd_send_signal 424
+# endif
+# ifndef SYS_pidfd_open
+#  define SYS_pidfd_open 434
+# endif
+
+# ifndef HAVE_PIDFD_SEND_SIGNAL
+static inline int pidfd_send_signal(int pidfd, int sig, siginfo_t *info,
+				    unsigned int flags)
+{
+	return syscall(SYS_pidfd_send_signal, pidfd, sig, info, flags);
+}
+# endif
+
+# ifndef HAVE_PIDFD_OPEN
+static inline int pidfd_open(pid_t pid, unsigned int flags)
+{
+	return syscall(SYS_pidfd_open, pid, flags);
+}
+# endif
+
+# define UL_HAVE_PIDFD 1
+
+#endif /* __linux__ */
+#endif /* UTIL_LINUX_PIDFD_UTILS */
@@ -0,0 +1,86 @@
+/*
+ * Kernel feature probing. Each probe issues the cheapest call that
+ * tells the feature apart from ENOSYS/EINVAL on older kernels, without
+ * side effects. The results pick the fastest mechanism for operations
+ * that have several, see RUnshare.features.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/statfs.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include "include/pidfd-utils.h"
+
+#include "kfeatures.h"
+
+#ifndef CGROUP2_SUPER_MAGIC
+# define CGROUP2_SUPER_MAGIC 0x63677270
+#endif
+
+struct rb_features rb_features;
+
+/* the syscall exists if it fails with anything but ENOSYS */
+static bool has_syscall(long rc)
+{
+    return rc == 0 || errno != ENOSYS;
+}
+
+static bool kernel_at_least(int major, int minor)
+{
+    struct utsname u;
+    int ma, mi;
+
+    if (uname(&u) != 0 || sscanf(u.release, "%d.%d", &ma, &mi) != 2)
+        return false;
+
+    return ma > major || (ma == major && mi >= minor);
+}
+
+/*
+ * A pidfd is not an nsfs file for older kernels, so setns() rejects it
+ * with EINVAL before looking at the caller's privileges. Joining our
+ * own uts namespace changes nothing if it is allowed.
+ */
+static bool probe_setns_pidfd(void)
+{
+    int pidfd, rc;
+    bool ok;
+
+    pidfd = pidfd_open(getpid(), 0);
+    if (pidfd < 0)
+        return false;
+
+    rc = setns(pidfd, CLONE_NEWUTS);
+    ok = rc == 0 || errno == EPERM;
+    close(pidfd);
+
+    return ok;
+}
+
+void rb_features_probe(void)
+{
+    struct statfs st;
+    int fd;
+
+    /* a NULL args of size 0 is EINVAL (or EFAULT), not a new process */
+    rb_features.clone3 = has_syscall(syscall(SYS_clone3, NULL, 0));
+
+    fd = pidfd_open(getpid(), 0);
+    rb_features.pidfd_open = fd >= 0;
+    if (fd >= 0)
+        close(fd);
+
+    rb_features.setns_pidfd = rb_features.pidfd_open && probe_setns_pidfd();
+    rb_features.mount_api = has_syscall(syscall(SYS_fsopen, NULL, 0));
+    rb_features.idmapped_mounts = has_syscall(syscall(SYS_mount_setattr, -1, NULL, 0, NULL, 0));
+    rb_features.cgroup2 = statfs("/sys/fs/cgroup", &st) == 0 && st.f_type == CGROUP2_SUPER_MAGIC;
+    rb_features.clone_into_cgroup = rb_features.clone3 && rb_features.cgroup2 &&
+                                    kernel_at_least(5, 7);
+    rb_features.time_ns = access("/proc/self/ns/time", F_OK) == 0;
+
+    /* the empty range ~0U..~0U closes nothing */
+    rb_features.close_range = syscall(SYS_close_range, ~0U, ~0U, 0) == 0;
+}
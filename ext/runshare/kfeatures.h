@@ -0,0 +1,39 @@
+#ifndef KFEATURES_H
+#define KFEATURES_H 1
+
+#include <stdbool.h>
+
+#include <sys/syscall.h>
+
+#ifndef SYS_clone3
+# define SYS_clone3 435
+#endif
+#ifndef SYS_close_range
+# define SYS_close_range 436
+#endif
+#ifndef SYS_fsopen
+# define SYS_fsopen 430
+#endif
+#ifndef SYS_mount_setattr
+# define SYS_mount_setattr 442
+#endif
+
+/* what the running kernel supports, probed once at load time */
+struct rb_features {
+    bool clone3;
+    bool pidfd_open;
+    bool setns_pidfd;		/* Linux 5.8 */
+    bool mount_api;		/* fsopen() and friends */
+    bool idmapped_mounts;	/* mount_setattr() */
+    bool cgroup2;
+    bool clone_into_cgroup;
+    bool time_ns;
+    bool close_range;
+};
+
+/* read-only once rb_features_probe() has run from Init_runshare */
+extern struct rb_features rb_features;
+
+void rb_features_probe(void);
+
+#endif
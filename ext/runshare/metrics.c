@@ -0,0 +1,147 @@
+/*
+ * Counters and latency histograms of the sandbox lifecycle, see
+ * RUnshare.metrics. They are bumped on every spawn and wait, from many
+ * threads and Ractors at once, so the hot ones live in shards padded to
+ * cache lines: a thread keeps to the shard it got first and updates it
+ * with relaxed atomics, a snapshot sums the shards up. Failures are rare
+ * and keyed by (step, errno), they go to one table under a mutex.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#define METRICS_SHARDS	16
+
+const uint64_t rb_metrics_bounds[METRICS_BUCKETS - 1] = {
+    50000, 100000, 250000, 500000,			/* 50us .. 500us */
+    1000000, 2500000, 5000000, 10000000,		/* 1ms .. 10ms */
+    25000000, 50000000, 100000000, 250000000,		/* 25ms .. 250ms */
+    1000000000,						/* 1s */
+};
+
+struct metrics_shard {
+    uint64_t created[METRICS_NS_SETS];
+    struct rb_metrics_histogram create[METRICS_PATHS];
+    struct rb_metrics_histogram wait;
+    uint64_t reaped;
+} __attribute__((aligned(64)));
+
+static struct metrics_shard shards[METRICS_SHARDS];
+static unsigned int next_shard;
+static __thread int shard_idx = -1;
+
+static pthread_mutex_t failures_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rb_metrics_failure failures[METRICS_FAILURES];
+static int nfailures;
+
+#define COUNTER_ADD(p, v)	__atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define COUNTER_GET(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+
+uint64_t rb_metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct metrics_shard *shard(void)
+{
+    if (shard_idx < 0)
+        shard_idx = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % METRICS_SHARDS;
+    return &shards[shard_idx];
+}
+
+static void observe(struct rb_metrics_histogram *h, uint64_t since)
+{
+    uint64_t ns = rb_metrics_now() - since;
+    int i;
+
+    for (i = 0; i < METRICS_BUCKETS - 1 && ns > rb_metrics_bounds[i]; i++);
+    COUNTER_ADD(&h->buckets[i], 1);
+    COUNTER_ADD(&h->sum_ns, ns);
+}
+
+void rb_metrics_created(unsigned int ns_set, int path, uint64_t since)
+{
+    struct metrics_shard *s = shard();
+
+    COUNTER_ADD(&s->created[ns_set % METRICS_NS_SETS], 1);
+    observe(&s->create[path], since);
+}
+
+void rb_metrics_reaped(uint64_t since)
+{
+    struct metrics_shard *s = shard();
+
+    COUNTER_ADD(&s->reaped, 1);
+    observe(&s->wait, since);
+}
+
+void rb_metrics_failed(const char *step, int err)
+{
+    int i;
+
+    pthread_mutex_lock(&failures_lock);
+    for (i = 0; i < nfailures; i++) {
+        if (failures[i].step == step && failures[i].err == err)
+            break;
+    }
+    if (i == nfailures) {
+        if (nfailures < METRICS_FAILURES - 1) {
+            failures[nfailures++] = (struct rb_metrics_failure) { .step = step, .err = err };
+        } else {
+            /* the last slot collects the rest */
+            i = METRICS_FAILURES - 1;
+            failures[i].step = NULL;
+            failures[i].err = 0;
+            nfailures = METRICS_FAILURES;
+        }
+    }
+    failures[i].count++;
+    pthread_mutex_unlock(&failures_lock);
+}
+
+static void histogram_sum(struct rb_metrics_histogram *to, const struct rb_metrics_histogram *h)
+{
+    int i;
+
+    for (i = 0; i < METRICS_BUCKETS; i++)
+        to->buckets[i] += COUNTER_GET(&h->buckets[i]);
+    to->sum_ns += COUNTER_GET(&h->sum_ns);
+}
+
+static void histogram_cumulate(struct rb_metrics_histogram *h)
+{
+    int i;
+
+    for (i = 1; i < METRICS_BUCKETS; i++)
+        h->buckets[i] += h->buckets[i - 1];
+}
+
+/* the counters may move while they are summed, each one is consistent */
+void rb_metrics_snapshot(struct rb_metrics *m)
+{
+    int i, j;
+
+    memset(m, 0, sizeof(*m));
+    for (i = 0; i < METRICS_SHARDS; i++) {
+        for (j = 0; j < METRICS_NS_SETS; j++)
+            m->created[j] += COUNTER_GET(&shards[i].created[j]);
+        for (j = 0; j < METRICS_PATHS; j++)
+            histogram_sum(&m->create[j], &shards[i].create[j]);
+        histogram_sum(&m->wait, &shards[i].wait);
+        m->reaped += COUNTER_GET(&shards[i].reaped);
+    }
+    for (j = 0; j < METRICS_PATHS; j++)
+        histogram_cumulate(&m->create[j]);
+    histogram_cumulate(&m->wait);
+
+    pthread_mutex_lock(&failures_lock);
+    memcpy(m->failures, failures, sizeof(failures));
+    m->nfailures = nfailures;
+    pthread_mutex_unlock(&failures_lock);
+}
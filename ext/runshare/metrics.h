@@ -0,0 +1,51 @@
+#ifndef METRICS_H
+#define METRICS_H 1
+
+#include <stdint.h>
+
+#include "unshare.h"
+
+/* upper bounds of the latency buckets in ns, the last one is +Inf */
+#define METRICS_BUCKETS	14
+extern const uint64_t rb_metrics_bounds[METRICS_BUCKETS - 1];
+
+/* one set of namespaces per bit combination, bits as in namespace_files */
+#define METRICS_NS_SETS	(1 << UNSHARE_NS_COUNT)
+
+/* kept (step, errno) pairs of failures, more add up under a NULL step */
+#define METRICS_FAILURES	64
+
+enum {
+    METRICS_PATH_SPAWN,	/* clone until execve */
+    METRICS_PATH_FORK,	/* unshare with fork until the child is set up */
+    METRICS_PATHS
+};
+
+struct rb_metrics_histogram {
+    uint64_t buckets[METRICS_BUCKETS];	/* cumulative in a snapshot */
+    uint64_t sum_ns;
+};
+
+struct rb_metrics_failure {
+    const char *step;	/* static string */
+    int err;
+    uint64_t count;
+};
+
+struct rb_metrics {
+    uint64_t created[METRICS_NS_SETS];
+    struct rb_metrics_histogram create[METRICS_PATHS];
+    struct rb_metrics_histogram wait;
+    uint64_t reaped;
+
+    struct rb_metrics_failure failures[METRICS_FAILURES];
+    int nfailures;
+};
+
+uint64_t rb_metrics_now(void);
+void rb_metrics_created(unsigned int ns_set, int path, uint64_t since);
+void rb_metrics_failed(const char *step, int err);
+void rb_metrics_reaped(uint64_t since);
+void rb_metrics_snapshot(struct rb_metrics *m);
+
+#endif
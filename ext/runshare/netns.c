@@ -0,0 +1,821 @@
+/*
+ * Network namespace recycling. Destroying a network namespace is queued
+ * to the kernel's cleanup_net worker, which falls behind when thousands
+ * of them go away per minute, and new unshare(CLONE_NEWNET) calls stall
+ * behind it. Instead, the namespaces of spawned children are kept pinned
+ * by fd, flushed once the child is gone and handed to later
+ * clone_newnet requests. Nothing of one tenant may reach the next: the
+ * flush covers links, nexthops, addresses, routes, policy rules,
+ * nftables, conntrack and the net.* sysctls. What it can not reset, legacy iptables tables, keeps
+ * the namespace from being recycled.
+ */
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/fib_rules.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netlink.h>
+#include <linux/nexthop.h>
+#include <linux/rtnetlink.h>
+
+#include "include/c.h"
+
+#include "netns.h"
+
+/* in a new network namespace lo is always the first device */
+#define LOOPBACK_IFINDEX	1
+
+/* deletions may race with the dump, so repeat until nothing is left */
+#define NETNS_FLUSH_PASSES	8
+
+#define NL_BUFSIZE		16384
+
+#define NETNS_SYSCTL_DIR	"/proc/sys/net"
+
+/* restores may change related sysctls, repeat while anything was written */
+#define NETNS_SYSCTL_PASSES	3
+
+struct nl_req {
+    struct nlmsghdr n;
+    struct ifinfomsg i;
+    char attrs[64];
+};
+
+static int nl_open(void)
+{
+    return socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+}
+
+/* sends len bytes of messages and waits for the first ack or error */
+static int nl_send_ack(int sk, const void *msgs, size_t len)
+{
+    char buf[1024];
+    struct nlmsghdr *h;
+    ssize_t n;
+
+    if (send(sk, msgs, len, 0) < 0)
+        return -1;
+
+    for (;;) {
+        n = recv(sk, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (h = (struct nlmsghdr *) buf; NLMSG_OK(h, n); h = NLMSG_NEXT(h, n)) {
+            if (h->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr *e = NLMSG_DATA(h);
+
+                if (e->error == 0)
+                    return 0;
+                errno = -e->error;
+                return -1;
+            }
+        }
+    }
+}
+
+/* sends req and waits for the ack, returns 0 or -1 with errno set */
+static int nl_talk(int sk, struct nlmsghdr *req)
+{
+    req->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req->nlmsg_seq = 0;
+
+    return nl_send_ack(sk, req, req->nlmsg_len);
+}
+
+/*
+ * Dumps objects of type on dump and calls fn for each, fn may talk to
+ * the kernel over talk. Returns the sum of what fn returned or -1.
+ */
+static int nl_dump(int dump, int talk, int type,
+                   int (*fn)(int talk, struct nlmsghdr *h, void *data), void *data)
+{
+    /* nexthop dumps want their full header, the others take the family only */
+    struct {
+        struct nlmsghdr n;
+        union {
+            struct rtgenmsg g;
+            struct nhmsg nh;
+        };
+    } req = {
+        .n.nlmsg_len = NLMSG_LENGTH(type == RTM_GETNEXTHOP ? sizeof(struct nhmsg)
+                                                          : sizeof(struct rtgenmsg)),
+        .n.nlmsg_type = type,
+        .n.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+        .g.rtgen_family = AF_UNSPEC,
+    };
+    char buf[NL_BUFSIZE];
+    struct nlmsghdr *h;
+    int count = 0;
+    ssize_t n;
+
+    if (send(dump, &req, req.n.nlmsg_len, 0) < 0)
+        return -1;
+
+    for (;;) {
+        n = recv(dump, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (h = (struct nlmsghdr *) buf; NLMSG_OK(h, n); h = NLMSG_NEXT(h, n)) {
+            if (h->nlmsg_type == NLMSG_DONE)
+                return count;
+            if (h->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr *e = NLMSG_DATA(h);
+
+                errno = -e->error;
+                return -1;
+            }
+            count += fn(talk, h, data);
+        }
+    }
+}
+
+static void nl_addattr32(struct nlmsghdr *n, int type, uint32_t val)
+{
+    struct rtattr *rta = (struct rtattr *) ((char *) n + NLMSG_ALIGN(n->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(sizeof(val));
+    memcpy(RTA_DATA(rta), &val, sizeof(val));
+    n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+static int link_flush(int talk, struct nlmsghdr *h, void *data)
+{
+    struct ifinfomsg *ifi = NLMSG_DATA(h);
+    int home = *(int *) data;
+    struct nl_req req = {
+        .n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg)),
+        .n.nlmsg_type = RTM_DELLINK,
+        .i.ifi_family = AF_UNSPEC,
+        .i.ifi_index = ifi->ifi_index,
+    };
+
+    if (ifi->ifi_flags & IFF_LOOPBACK)
+        return 0;
+    if (nl_talk(talk, &req.n) == 0)
+        return 1;
+
+    /* physical devices can not be deleted, send them back home */
+    if (home < 0)
+        return 0;
+    req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.n.nlmsg_type = RTM_NEWLINK;
+    nl_addattr32(&req.n, IFLA_NET_NS_FD, home);
+
+    return nl_talk(talk, &req.n) == 0;
+}
+
+/* deletes the dumped address or route by sending it back as RTM_DEL* */
+static int object_flush(int talk, struct nlmsghdr *h, void *data)
+{
+    h->nlmsg_type = *(int *) data;
+
+    return nl_talk(talk, h) == 0;
+}
+
+/* deletes the dumped nexthop by id, the only attribute RTM_DELNEXTHOP takes */
+static int nexthop_flush(int talk, struct nlmsghdr *h, void *data __attribute__((unused)))
+{
+    struct nhmsg *nhm = NLMSG_DATA(h);
+    struct rtattr *rta = (struct rtattr *) ((char *) nhm + NLMSG_ALIGN(sizeof(*nhm)));
+    int len = h->nlmsg_len - NLMSG_LENGTH(sizeof(*nhm));
+    struct {
+        struct nlmsghdr n;
+        struct nhmsg nh;
+        char attrs[16];
+    } req = {
+        .n.nlmsg_len = NLMSG_LENGTH(sizeof(struct nhmsg)),
+        .n.nlmsg_type = RTM_DELNEXTHOP,
+        .nh.nh_family = AF_UNSPEC,
+    };
+
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == NHA_ID) {
+            nl_addattr32(&req.n, NHA_ID, *(uint32_t *) RTA_DATA(rta));
+            return nl_talk(talk, &req.n) == 0;
+        }
+    }
+    return 0;
+}
+
+/* the rules every new namespace starts with, lookups in local, main and default */
+static const struct default_rule {
+    uint8_t family;
+    uint32_t priority;
+    uint8_t table;
+} default_rules[] = {
+    { AF_INET, 0, RT_TABLE_LOCAL },
+    { AF_INET, 32766, RT_TABLE_MAIN },
+    { AF_INET, 32767, RT_TABLE_DEFAULT },
+    { AF_INET6, 0, RT_TABLE_LOCAL },
+    { AF_INET6, 32766, RT_TABLE_MAIN },
+};
+
+/* a plain table lookup at the priority of a default rule, without selectors */
+static int rule_is_default(struct nlmsghdr *h)
+{
+    struct fib_rule_hdr *frh = NLMSG_DATA(h);
+    struct rtattr *rta = (struct rtattr *) ((char *) frh + NLMSG_ALIGN(sizeof(*frh)));
+    int len = h->nlmsg_len - NLMSG_LENGTH(sizeof(*frh));
+    uint32_t priority = 0, table = frh->table;
+    size_t i;
+
+    if (frh->dst_len || frh->src_len || frh->tos || frh->flags ||
+        frh->action != FR_ACT_TO_TBL)
+        return 0;
+
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+        case FRA_PRIORITY:
+            priority = *(uint32_t *) RTA_DATA(rta);
+            break;
+        case FRA_TABLE:
+            table = *(uint32_t *) RTA_DATA(rta);
+            break;
+        case FRA_PROTOCOL:
+            break;
+        case FRA_SUPPRESS_PREFIXLEN:
+            if (*(uint32_t *) RTA_DATA(rta) != (uint32_t) -1)
+                return 0;
+            break;
+        default:
+            return 0;
+        }
+    }
+
+    for (i = 0; i < ARRAY_SIZE(default_rules); i++) {
+        if (default_rules[i].family == frh->family &&
+            default_rules[i].priority == priority && default_rules[i].table == table)
+            return 1;
+    }
+    return 0;
+}
+
+/* deletes the dumped policy rule unless it is one of default_rules */
+static int rule_flush(int talk, struct nlmsghdr *h, void *data __attribute__((unused)))
+{
+    if (rule_is_default(h))
+        return 0;
+    h->nlmsg_type = RTM_DELRULE;
+
+    return nl_talk(talk, h) == 0;
+}
+
+/* puts back the default rules a tenant deleted, the others exist already */
+static int rules_restore(int talk)
+{
+    struct {
+        struct nlmsghdr n;
+        struct fib_rule_hdr frh;
+        char attrs[32];
+    } req;
+    struct rtattr *rta;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(default_rules); i++) {
+        memset(&req, 0, sizeof(req));
+        req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct fib_rule_hdr));
+        req.n.nlmsg_type = RTM_NEWRULE;
+        req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL;
+        req.frh.family = default_rules[i].family;
+        req.frh.table = default_rules[i].table;
+        req.frh.action = FR_ACT_TO_TBL;
+        nl_addattr32(&req.n, FRA_PRIORITY, default_rules[i].priority);
+
+        rta = (struct rtattr *) ((char *) &req.n + NLMSG_ALIGN(req.n.nlmsg_len));
+        rta->rta_type = FRA_PROTOCOL;
+        rta->rta_len = RTA_LENGTH(sizeof(uint8_t));
+        *(uint8_t *) RTA_DATA(rta) = RTPROT_KERNEL;
+        req.n.nlmsg_len = NLMSG_ALIGN(req.n.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+
+        /* kernels without IPv6 have no rules for it to restore */
+        if (nl_send_ack(talk, &req, req.n.nlmsg_len) < 0 &&
+            errno != EEXIST && errno != EAFNOSUPPORT)
+            return -1;
+    }
+    return 0;
+}
+
+static int flush(int dump, int talk, int type, int del)
+{
+    int pass, n;
+
+    for (pass = 0; pass < NETNS_FLUSH_PASSES; pass++) {
+        if (type == RTM_GETLINK)
+            n = nl_dump(dump, talk, type, link_flush, &del);
+        else if (type == RTM_GETNEXTHOP)
+            n = nl_dump(dump, talk, type, nexthop_flush, NULL);
+        else if (type == RTM_GETRULE)
+            n = nl_dump(dump, talk, type, rule_flush, NULL);
+        else
+            n = nl_dump(dump, talk, type, object_flush, &del);
+        if (n <= 0)
+            return n;
+    }
+    return 0;
+}
+
+/* a netfilter message without attributes */
+struct nfnl_msg {
+    struct nlmsghdr n;
+    struct nfgenmsg g;
+};
+
+static void nfnl_init(struct nfnl_msg *m, int type, int flags, int res_id)
+{
+    memset(m, 0, sizeof(*m));
+    m->n.nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    m->n.nlmsg_type = type;
+    m->n.nlmsg_flags = NLM_F_REQUEST | flags;
+    m->g.nfgen_family = AF_UNSPEC;
+    m->g.version = NFNETLINK_V0;
+    m->g.res_id = htons(res_id);
+}
+
+/*
+ * Deletes the nftables tables of all families, like nft flush ruleset,
+ * which covers iptables-nft too, and the conntrack entries. Missing
+ * subsystems have nothing to flush.
+ */
+static int netfilter_flush(void)
+{
+    struct nfnl_msg batch[3], ct;
+    int sk, rc = 0, e;
+
+    sk = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    if (sk < 0)
+        return errno == EPROTONOSUPPORT ? 0 : -1;
+
+    nfnl_init(&batch[0], NFNL_MSG_BATCH_BEGIN, 0, NFNL_SUBSYS_NFTABLES);
+    nfnl_init(&batch[1], (NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_DELTABLE, NLM_F_ACK, 0);
+    nfnl_init(&batch[2], NFNL_MSG_BATCH_END, 0, NFNL_SUBSYS_NFTABLES);
+    if (nl_send_ack(sk, batch, sizeof(batch)) < 0 && errno != EOPNOTSUPP)
+        rc = -1;
+
+    /* without the conntrack module there is no table and no sysctl of it */
+    nfnl_init(&ct, (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_DELETE, NLM_F_ACK, 0);
+    if (rc == 0 && access(NETNS_SYSCTL_DIR "/netfilter/nf_conntrack_max", F_OK) == 0 &&
+        nl_send_ack(sk, &ct, ct.n.nlmsg_len) < 0)
+        rc = -1;
+
+    e = errno;
+    close(sk);
+    errno = e;
+    return rc;
+}
+
+/* x_tables of iptables-legacy exist once used, there is no flush for them */
+static int legacy_tables_used(void)
+{
+    static const char *const names[] = {
+        "/proc/self/net/ip_tables_names",
+        "/proc/self/net/ip6_tables_names",
+        "/proc/self/net/arp_tables_names",
+    };
+    size_t i;
+    ssize_t n;
+    char c;
+    int fd;
+
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        fd = open(names[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        n = read(fd, &c, 1);
+        close(fd);
+        if (n > 0)
+            return 1;
+    }
+    return 0;
+}
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*
+ * Appends the sysctls below dir that can be read and written to buf,
+ * as "name\0value\0" records with name relative to NETNS_SYSCTL_DIR.
+ * name holds the nlen bytes of the path of dir.
+ */
+static int snapshot_dir(int dir, char *name, size_t nlen, char *buf, size_t size, size_t *off)
+{
+    char dents[4096], val[4096];
+    struct linux_dirent64 *d;
+    struct stat st;
+    long n, pos;
+    ssize_t vlen;
+    size_t len;
+    int fd, rc;
+
+    while ((n = syscall(SYS_getdents64, dir, dents, sizeof(dents))) > 0) {
+        for (pos = 0; pos < n; pos += d->d_reclen) {
+            d = (struct linux_dirent64 *) (dents + pos);
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                continue;
+
+            len = strlen(d->d_name);
+            if (nlen + len + 2 > PATH_MAX) {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            memcpy(name + nlen, d->d_name, len + 1);
+
+            if (d->d_type == DT_DIR) {
+                fd = openat(dir, d->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd < 0)
+                    return -1;
+                name[nlen + len] = '/';
+                rc = snapshot_dir(fd, name, nlen + len + 1, buf, size, off);
+                close(fd);
+                if (rc < 0)
+                    return -1;
+                continue;
+            }
+
+            if (fstatat(dir, d->d_name, &st, 0) != 0 ||
+                (st.st_mode & (S_IRUSR | S_IWUSR)) != (S_IRUSR | S_IWUSR))
+                continue;
+            fd = openat(dir, d->d_name, O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                continue;
+            vlen = read(fd, val, sizeof(val) - 1);
+            close(fd);
+            if (vlen < 0)
+                continue;
+
+            if (*off + nlen + len + 1 + vlen + 1 > size) {
+                errno = ENOSPC;
+                return -1;
+            }
+            memcpy(buf + *off, name, nlen + len + 1);
+            *off += nlen + len + 1;
+            memcpy(buf + *off, val, vlen);
+            buf[*off + vlen] = '\0';
+            *off += vlen + 1;
+        }
+    }
+
+    return n < 0 ? -1 : 0;
+}
+
+/*
+ * Records the net.* sysctls of the current network namespace, which is
+ * fresh from creation, to buf for rb_netns_flush(). Allocates nothing,
+ * so it can run in a clone_vfork() child. Returns the length, or -1
+ * with errno set.
+ */
+ssize_t rb_netns_snapshot(char *buf, size_t size)
+{
+    char name[PATH_MAX];
+    size_t off = 0;
+    int dir, rc, e;
+
+    dir = open(NETNS_SYSCTL_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir < 0)
+        return -1;
+    name[0] = '\0';
+    rc = snapshot_dir(dir, name, 0, buf, size, &off);
+    e = errno;
+    close(dir);
+    errno = e;
+
+    return rc < 0 ? -1 : (ssize_t) off;
+}
+
+/* the sysctls of a new network namespace, published once */
+static const char *netns_baseline;
+static size_t netns_baseline_len;
+
+/*
+ * Writes back the sysctls that differ from the baseline. Some of them
+ * change others (conf/all sets every device), so it repeats until a
+ * pass writes nothing. A value that can not be restored fails with
+ * ENOTEMPTY.
+ */
+static int restore_sysctls(const char *base, size_t len)
+{
+    char val[4096];
+    const char *p, *v;
+    int dir, fd, pass, changed = 0;
+    size_t vlen;
+    ssize_t n;
+
+    dir = open(NETNS_SYSCTL_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir < 0)
+        return -1;
+
+    for (pass = 0; pass < NETNS_SYSCTL_PASSES; pass++) {
+        changed = 0;
+        for (p = base; p < base + len; p = v + vlen + 1) {
+            v = p + strlen(p) + 1;
+            vlen = strlen(v);
+
+            /* gone with its device, or not writable from here */
+            fd = openat(dir, p, O_RDWR | O_CLOEXEC);
+            if (fd < 0)
+                continue;
+            n = read(fd, val, sizeof(val));
+            if (n == (ssize_t) vlen && memcmp(val, v, vlen) == 0) {
+                close(fd);
+                continue;
+            }
+            n = pwrite(fd, v, vlen, 0);
+            close(fd);
+            if (n != (ssize_t) vlen) {
+                changed = -1;
+                break;
+            }
+            changed++;
+        }
+        if (changed <= 0)
+            break;
+    }
+    close(dir);
+
+    if (changed) {
+        errno = ENOTEMPTY;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Brings the current network namespace back to the state of a new one:
+ * deletes all links but lo (or moves them to the namespace of the fd
+ * home), takes lo down without addresses, flushes the nexthops, the
+ * routes, the policy rules but the default ones (putting back deleted
+ * defaults), the nftables rules and conntrack, and restores the
+ * sysctls recorded by rb_netns_snapshot(). The kernel puts 127.0.0.1 back once lo is
+ * brought up again. Fails with ENOTEMPTY if the namespace keeps state
+ * that can not be reset: legacy iptables tables, or sysctls without a
+ * baseline. Allocates nothing, so it can run in a clone_vfork() child.
+ */
+int rb_netns_flush(int home)
+{
+    struct nl_req lo = {
+        .n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg)),
+        .n.nlmsg_type = RTM_NEWLINK,
+        .i.ifi_family = AF_UNSPEC,
+        .i.ifi_index = LOOPBACK_IFINDEX,
+        .i.ifi_change = IFF_UP,
+    };
+    const char *base;
+    int dump = -1, talk = -1, rc = -1, e;
+
+    if ((dump = nl_open()) < 0 || (talk = nl_open()) < 0)
+        goto done;
+
+    if (flush(dump, talk, RTM_GETLINK, home) < 0)
+        goto done;
+    if (nl_talk(talk, &lo.n) < 0)
+        goto done;
+    /* kernels before 5.3 have no nexthop objects */
+    if (flush(dump, talk, RTM_GETNEXTHOP, RTM_DELNEXTHOP) < 0 && errno != EOPNOTSUPP)
+        goto done;
+    if (flush(dump, talk, RTM_GETADDR, RTM_DELADDR) < 0)
+        goto done;
+    if (flush(dump, talk, RTM_GETROUTE, RTM_DELROUTE) < 0)
+        goto done;
+    if (flush(dump, talk, RTM_GETRULE, RTM_DELRULE) < 0 || rules_restore(talk) < 0)
+        goto done;
+
+    if (legacy_tables_used()) {
+        errno = ENOTEMPTY;
+        goto done;
+    }
+    if (netfilter_flush() < 0)
+        goto done;
+    base = __atomic_load_n(&netns_baseline, __ATOMIC_ACQUIRE);
+    if (!base) {
+        errno = ENOTEMPTY;
+        goto done;
+    }
+    if (restore_sysctls(base, netns_baseline_len) < 0)
+        goto done;
+    rc = 0;
+
+done:
+    e = errno;
+    if (dump >= 0)
+        close(dump);
+    if (talk >= 0)
+        close(talk);
+    errno = e;
+    return rc;
+}
+
+/*
+ * The cache and the owner table are guarded by netns_lock, as the
+ * callers run without the GVL. Namespaces are flushed and created
+ * outside of it.
+ */
+static pthread_mutex_t netns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* flushed namespaces ready for reuse */
+static struct rb_unshare_nsset *netns_cache;
+static int netns_ncached;
+static int netns_cache_max;	/* 0 turns recycling off */
+
+/* namespaces handed to spawned children, recycled by rb_netns_release() */
+static struct netns_owner {
+    pid_t pid;
+    struct rb_unshare_nsset set;
+} *netns_owners;
+static int netns_nowners;
+
+int rb_netns_cache_size(void)
+{
+    return netns_cache_max;
+}
+
+int rb_netns_set_cache_size(int size)
+{
+    struct rb_unshare_nsset *cache;
+
+    pthread_mutex_lock(&netns_lock);
+    while (netns_ncached > size)
+        rb_unshare_nsset_close(&netns_cache[--netns_ncached]);
+
+    cache = realloc(netns_cache, sizeof(*netns_cache) * (size ?: 1));
+    if (!cache && size > netns_cache_max) {
+        pthread_mutex_unlock(&netns_lock);
+        return -1;
+    }
+    /* a failed shrink keeps the bigger buffer */
+    if (cache)
+        netns_cache = cache;
+    netns_cache_max = size;
+    pthread_mutex_unlock(&netns_lock);
+
+    return 0;
+}
+
+int rb_netns_cached(void)
+{
+    return netns_ncached;
+}
+
+int rb_netns_need_baseline(void)
+{
+    return !__atomic_load_n(&netns_baseline, __ATOMIC_ACQUIRE);
+}
+
+/* takes buf, len bytes from rb_netns_snapshot() or -1, as the baseline */
+void rb_netns_set_baseline(char *buf, ssize_t len)
+{
+    pthread_mutex_lock(&netns_lock);
+    if (!netns_baseline && len > 0) {
+        netns_baseline_len = len;
+        __atomic_store_n(&netns_baseline, buf, __ATOMIC_RELEASE);
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&netns_lock);
+
+    free(buf);
+}
+
+/*
+ * Provides the network namespace of a clone_newnet request from the
+ * cache, or a fresh pinned one to be recycled later, and makes args
+ * enter it instead of creating one. Namespaces owned by a new user
+ * namespace are not recycled. Returns 1 if set was filled, 0 if args
+ * is not a candidate, or -1 with errno set and *step.
+ */
+int rb_netns_acquire(struct rb_unshare_args *args, struct rb_unshare_nsset *set,
+                     const char **step)
+{
+    struct rb_unshare_args probe = *args;
+    int flags, cached = 0;
+
+    if (!netns_cache_max || args->nsset)
+        return 0;
+
+    flags = rb_unshare_prepare(&probe, geteuid(), getegid());
+    if (!(flags & CLONE_NEWNET) || (flags & CLONE_NEWUSER))
+        return 0;
+
+    pthread_mutex_lock(&netns_lock);
+    if (netns_ncached > 0) {
+        *set = netns_cache[--netns_ncached];
+        cached = 1;
+    }
+    pthread_mutex_unlock(&netns_lock);
+
+    if (!cached && rb_unshare_nsset_create(set, CLONE_NEWNET, NULL, step) < 0)
+        return -1;
+
+    args->clone_newnet = false;
+    args->nsset = set;
+    args->netns_recycled = true;
+    return 1;
+}
+
+/*
+ * Flushes set and puts it into the cache, or closes it if the cache is
+ * full or the flush could not reset it. Returns -1 with errno set and *step if the flush failed.
+ */
+int rb_netns_recycle(struct rb_unshare_nsset *set, const char **step)
+{
+    int full, e;
+
+    pthread_mutex_lock(&netns_lock);
+    full = netns_ncached >= netns_cache_max;
+    pthread_mutex_unlock(&netns_lock);
+
+    /* without a baseline the sysctls could not be restored */
+    if (full || rb_netns_need_baseline()) {
+        rb_unshare_nsset_close(set);
+        return 0;
+    }
+    if (rb_unshare_nsset_reset(set, NULL, step) < 0) {
+        e = errno;
+        rb_unshare_nsset_close(set);
+        /* kept state of the last tenant, it is not handed on */
+        if (e == ENOTEMPTY)
+            return 0;
+        errno = e;
+        return -1;
+    }
+
+    /* the cache may have filled up or shrunk meanwhile */
+    pthread_mutex_lock(&netns_lock);
+    full = netns_ncached >= netns_cache_max;
+    if (!full)
+        netns_cache[netns_ncached++] = *set;
+    pthread_mutex_unlock(&netns_lock);
+
+    if (full)
+        rb_unshare_nsset_close(set);
+    return 0;
+}
+
+void rb_netns_track(pid_t pid, struct rb_unshare_nsset *set)
+{
+    struct netns_owner *owners;
+
+    pthread_mutex_lock(&netns_lock);
+    owners = realloc(netns_owners, sizeof(*owners) * (netns_nowners + 1));
+    if (owners) {
+        netns_owners = owners;
+        netns_owners[netns_nowners].pid = pid;
+        netns_owners[netns_nowners].set = *set;
+        netns_nowners++;
+    }
+    pthread_mutex_unlock(&netns_lock);
+
+    if (!owners)
+        rb_unshare_nsset_close(set);
+}
+
+/*
+ * Recycles the network namespace given to pid, which should be gone.
+ * Returns 0 if there was none or it was recycled (or dropped because
+ * the cache is full), -1 with errno set and *step otherwise.
+ */
+int rb_netns_release(pid_t pid, const char **step)
+{
+    struct rb_unshare_nsset set;
+    int i, found = 0;
+
+    pthread_mutex_lock(&netns_lock);
+    for (i = 0; i < netns_nowners; i++) {
+        if (netns_owners[i].pid == pid) {
+            set = netns_owners[i].set;
+            netns_owners[i] = netns_owners[--netns_nowners];
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&netns_lock);
+
+    if (!found)
+        return 0;
+
+    return rb_netns_recycle(&set, step);
+}
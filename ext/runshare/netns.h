@@ -0,0 +1,23 @@
+#ifndef NETNS_H
+#define NETNS_H 1
+
+#include "unshare.h"
+
+/* room for the sysctls of a new network namespace, see rb_netns_snapshot() */
+#define NETNS_BASELINE_MAX	(128 * 1024)
+
+int rb_netns_flush(int home);
+ssize_t rb_netns_snapshot(char *buf, size_t size);
+int rb_netns_need_baseline(void);
+void rb_netns_set_baseline(char *buf, ssize_t len);
+
+int rb_netns_cache_size(void);
+int rb_netns_set_cache_size(int size);
+int rb_netns_cached(void);
+int rb_netns_acquire(struct rb_unshare_args *args, struct rb_unshare_nsset *set,
+                     const char **step);
+int rb_netns_recycle(struct rb_unshare_nsset *set, const char **step);
+void rb_netns_track(pid_t pid, struct rb_unshare_nsset *set);
+int rb_netns_release(pid_t pid, const char **step);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef PROBES_H
+#define PROBES_H 1
+
+#include <stdint.h>
+
+/*
+ * USDT probes of the namespace setup (provider "runshare"), for bpftrace
+ * or perf without changing code:
+ *
+ *   bpftrace -e 'usdt:/path/to/runshare.so:runshare:mount_proc
+ *                { printf("pid %d errno %d %d ns\n", arg1, arg2, arg3); }'
+ *
+ * Every probe takes (flags, pid, errno, elapsed ns). flags are the
+ * CLONE_NEW* flags of the call, the MS_* flags of a mount, the clock of
+ * settime or the inner id of map_id. pid is the process the step works
+ * on, 0 for the calling one; errno is 0 on success. Without sys/sdt.h
+ * the probes compile to nothing. With it every probe has a semaphore
+ * that the tracer raises while attached; untraced, a probe and its
+ * probe_now() cost one load and a not-taken branch, the clock is read
+ * and the arguments are computed only for a traced probe. The probes
+ * also fire in the CLONE_VM children, they do not allocate nor touch ruby.
+ */
+#define RUNSHARE_PROBES(X) \
+    X(unshare) X(fork) X(clone) X(bind_helper) X(bind) X(mount_bind) \
+    X(setup) X(map_id) X(settime) X(mount_propagation) X(mount_proc)
+
+#ifdef HAVE_SYS_SDT_H
+# define _SDT_HAS_SEMAPHORES 1
+# include <sys/sdt.h>
+# include <time.h>
+
+# define RUNSHARE_PROBE_SEMAPHORE_DECL(name) extern unsigned short runshare_##name##_semaphore;
+RUNSHARE_PROBES(RUNSHARE_PROBE_SEMAPHORE_DECL)
+# undef RUNSHARE_PROBE_SEMAPHORE_DECL
+
+/* the semaphores, in the one file that fires the probes */
+# define RUNSHARE_PROBE_SEMAPHORE(name) \
+    unsigned short runshare_##name##_semaphore __attribute__((section(".probes"), used));
+# define RUNSHARE_PROBE_SEMAPHORES RUNSHARE_PROBES(RUNSHARE_PROBE_SEMAPHORE)
+
+# define RUNSHARE_PROBE_ENABLED(name) __builtin_expect(runshare_##name##_semaphore, 0)
+
+static inline uint64_t probe_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* start of the step of probe name, 0 while it is not traced */
+# define probe_now(name) (RUNSHARE_PROBE_ENABLED(name) ? probe_clock() : 0)
+
+/* a tracer attached during the step sees an elapsed time of 0 */
+# define RUNSHARE_PROBE(name, flags, pid, err, since) do { \
+    if (RUNSHARE_PROBE_ENABLED(name)) { \
+        uint64_t since_ = (since); \
+        DTRACE_PROBE4(runshare, name, (long) (flags), (long) (pid), (long) (err), \
+                      (unsigned long) (since_ ? probe_clock() - since_ : 0)); \
+    } \
+} while (0)
+#else
+# define RUNSHARE_PROBE_SEMAPHORES
+# define probe_now(name) ((uint64_t) 0)
+# define RUNSHARE_PROBE(name, flags, pid, err, since) do { (void) (since); } while (0)
+#endif
+
+#endif
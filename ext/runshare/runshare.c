@@ -1,15 +1,31 @@
 #include <ruby.h>
+#include <ruby/ractor.h>
+#include <ruby/thread.h>
+#include <ruby/util.h>
 
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "kfeatures.h"
+#include "idcache.h"
+#include "metrics.h"
+#include "netns.h"
 #include "unshare.h"
+#include "zygote.h"
 
 #include "include/c.h"
-#include "include/pwdutils.h"
+#include "include/pidfd-utils.h"
 #include "include/strutils.h"
 
 /* we only need some defines missing in sys/mount.h, no libmount linkage */
 #include <libmount/libmount.h>
 
 static VALUE rb_mRUnshare;
+static VALUE rb_cZygote;
+static VALUE rb_cNamespaceSet;
+static VALUE rb_mRegistry;
+static VALUE rb_cSpec;
+static VALUE rb_eUnshareError;
 
 enum {
     CLONE_NEWUSER,
@@ -37,6 +53,9 @@ enum {
     FORCE_BOOTTIME,
     FORCE_MONOTONIC,
     KILL_CHILD,
+    UID_MAP,
+    GID_MAP,
+    TIMINGS,
     // list end marker
     FLAGS_COUNT
 };
@@ -66,9 +85,99 @@ static ID id_propagation;
 static ID id_force_boottime;
 static ID id_force_monotonic;
 static ID id_kill_child;
+static ID id_uid_map;
+static ID id_gid_map;
+static ID id_timings;
 
 static ID rb_unshare_keywords[FLAGS_COUNT];
 
+enum {
+    NSSET_CLONE_NEWUSER,
+    NSSET_CLONE_NEWCGROUP,
+    NSSET_CLONE_NEWIPC,
+    NSSET_CLONE_NEWUTS,
+    NSSET_CLONE_NEWNET,
+    NSSET_CLONE_NEWNS,
+    NSSET_SCRATCH,
+    // list end marker
+    NSSET_FLAGS_COUNT
+};
+
+static ID nsset_keywords[NSSET_FLAGS_COUNT];
+
+/* setns keywords, in the order of namespace_files */
+static const char *const setns_names[UNSHARE_NS_COUNT] = {
+    "user", "cgroup", "ipc", "uts", "net", "pid", "mnt", "time"
+};
+static ID setns_keywords[UNSHARE_NS_COUNT];
+
+static ID id_env;
+static ID id_ENV;
+static ID id_to_h;
+static ID id_for_fd;
+static ID id_fileno;
+static ID id_nsset;
+static ID id_scratch;
+static ID id_persist;
+static ID id_Child;
+static ID id_Result;
+static ID id_timings_iv;
+static ID id_rss_at_fork_iv;
+static ID id_new;
+static ID id_wait_m;
+static ID id_entry;
+static ID id_remove;
+static ID id_current;
+static ID id_main;
+static ID id_UnsafeError;
+static ID id_step;
+static ID id_errno;
+static VALUE exception_init;
+
+/*
+ * RUnshare::Error.new(step, errno)
+ *
+ * A SystemCallError naming the step of the namespace setup that failed.
+ * It matches the Errno class of its errno in rescue clauses as well.
+ */
+static VALUE
+rb_unshare_error_initialize(VALUE self, VALUE step, VALUE err) {
+    VALUE mesg;
+
+    step = rb_str_new_frozen(StringValue(step));
+    mesg = rb_sprintf("%s - %"PRIsVALUE, strerror(NUM2INT(err)), step);
+    rb_funcall(exception_init, rb_intern("bind_call"), 2, self, mesg);
+
+    /* the hidden ivar SystemCallError#errno and Errno::X.=== read */
+    rb_ivar_set(self, id_errno, INT2NUM(NUM2INT(err)));
+    rb_ivar_set(self, id_step, step);
+
+    return self;
+}
+
+/*
+ * SystemCallError.=== compares errnos against an Errno constant, which
+ * RUnshare::Error does not have; rescue it by class instead.
+ */
+static VALUE
+rb_unshare_error_eqq(VALUE self, VALUE exc) {
+    return rb_obj_is_kind_of(exc, self);
+}
+
+static void
+unshare_raise(int e, const char *step) {
+    VALUE argv[2] = { rb_str_new_cstr(step ? step : "unknown step"), INT2NUM(e ? e : EINVAL) };
+
+    rb_exc_raise(rb_class_new_instance(2, argv, rb_eUnshareError));
+}
+
+/* raises RUnshare::Error for a failed setup step, step is a static string */
+static void
+unshare_fail(int e, const char *step) {
+    rb_metrics_failed(step, e ? e : EINVAL);
+    unshare_raise(e, step);
+}
+
 static int
 setgroups_str2id(const char *str) {
     size_t i;
@@ -77,7 +186,7 @@ setgroups_str2id(const char *str) {
         if (strcmp(str, setgroups_strings[i]) == 0)
             return i;
 
-    errx(EXIT_FAILURE, _("unsupported --setgroups argument '%s'"), str);
+    rb_raise(rb_eArgError, "unsupported set_groups argument '%s'", str);
     return 0;
 }
 
@@ -99,7 +208,7 @@ parse_propagation(const char *str) {
             return opts[i].flag;
     }
 
-    errx(EXIT_FAILURE, _("unsupported propagation mode: %s"), str);
+    rb_raise(rb_eArgError, "unsupported propagation mode: %s", str);
 
     return 0;
 }
@@ -113,17 +222,10 @@ ensure_string_ne(VALUE v, const char *err) {
 
 static uid_t
 get_user(const char *s, const char *err) {
-    struct passwd *pw;
-    char *buf = NULL;
     uid_t ret;
 
-    pw = xgetpwnam(s, &buf);
-    if (pw) {
-        ret = pw->pw_uid;
-        free(pw);
-        free(buf);
-    } else {
-        ret = strtoul_or_err(s, err);
+    if (rb_idcache_user(s, &ret) < 0) {
+        rb_raise(rb_eArgError, "%s: %s", err, s);
     }
 
     return ret;
@@ -131,25 +233,232 @@ get_user(const char *s, const char *err) {
 
 static gid_t
 get_group(const char *s, const char *err) {
-    struct group *gr;
-    char *buf = NULL;
     gid_t ret;
 
-    gr = xgetgrnam(s, &buf);
-    if (gr) {
-        ret = gr->gr_gid;
-        free(gr);
-        free(buf);
-    } else {
-        ret = strtoul_or_err(s, err);
+    if (rb_idcache_group(s, &ret) < 0) {
+        rb_raise(rb_eArgError, "%s: %s", err, s);
     }
 
     return ret;
 }
 
+/* [[inner, outer, count], ...] into map, returns the number of lines */
+static int
+parse_idmap(VALUE v, struct rb_unshare_idmap *map, const char *name) {
+    long i;
+
+    v = rb_convert_type(v, T_ARRAY, "Array", "to_ary");
+    if (RARRAY_LEN(v) < 1 || RARRAY_LEN(v) > UNSHARE_IDMAP_MAX) {
+        rb_raise(rb_eArgError, "%s takes 1 to %d ranges", name, UNSHARE_IDMAP_MAX);
+    }
+
+    for (i = 0; i < RARRAY_LEN(v); i++) {
+        VALUE r = rb_convert_type(RARRAY_AREF(v, i), T_ARRAY, "Array", "to_ary");
+
+        if (RARRAY_LEN(r) != 3) {
+            rb_raise(rb_eArgError, "%s range is not [inner, outer, count]", name);
+        }
+        map[i].inner = NUM2UINT(RARRAY_AREF(r, 0));
+        map[i].outer = NUM2UINT(RARRAY_AREF(r, 1));
+        map[i].count = NUM2UINT(RARRAY_AREF(r, 2));
+        if (map[i].count == 0) {
+            rb_raise(rb_eArgError, "empty %s range", name);
+        }
+    }
+
+    return (int) i;
+}
+
+static void
+parse_unshare_args(VALUE opt, struct rb_unshare_args *args) {
+    VALUE kwvals[FLAGS_COUNT];
+
+    rb_get_kwargs(opt, rb_unshare_keywords, 0, FLAGS_COUNT, kwvals);
+
+    if (kwvals[CLONE_NEWUSER] != Qundef) args->clone_newuser = RTEST(kwvals[CLONE_NEWUSER]);
+    if (kwvals[CLONE_NEWCGROUP] != Qundef) args->clone_newcgroup = RTEST(kwvals[CLONE_NEWCGROUP]);
+    if (kwvals[CLONE_NEWIPC] != Qundef) args->clone_newipc = RTEST(kwvals[CLONE_NEWIPC]);
+    if (kwvals[CLONE_NEWUTS] != Qundef) args->clone_newuts = RTEST(kwvals[CLONE_NEWUTS]);
+    if (kwvals[CLONE_NEWNET] != Qundef) args->clone_newnet = RTEST(kwvals[CLONE_NEWNET]);
+    if (kwvals[CLONE_NEWPID] != Qundef) args->clone_newpid = RTEST(kwvals[CLONE_NEWPID]);
+    if (kwvals[CLONE_NEWNS] != Qundef) args->clone_newns = RTEST(kwvals[CLONE_NEWNS]);
+    if (kwvals[CLONE_NEWTIME] != Qundef) args->clone_newtime = RTEST(kwvals[CLONE_NEWTIME]);
+    if (args->clone_newtime && !rb_features.time_ns) {
+        rb_raise(rb_eNotImpError, "time namespaces are not supported by this kernel");
+    }
+    if (kwvals[FORK_ON_CLONE] != Qundef) args->fork = RTEST(kwvals[FORK_ON_CLONE]);
+    if (kwvals[WAIT_FORK] != Qundef) args->wait = RTEST(kwvals[WAIT_FORK]);
+    if (kwvals[MOUNT_PROC] != Qundef) {
+        ensure_string_ne(kwvals[MOUNT_PROC], "invalid mount type");
+        args->mount_proc = StringValueCStr(kwvals[MOUNT_PROC]);
+    }
+    if (kwvals[NEW_ROOT] != Qundef) {
+        ensure_string_ne(kwvals[NEW_ROOT], "invalid root type");
+        args->root = StringValueCStr(kwvals[NEW_ROOT]);
+    }
+    if (kwvals[NEW_DIR] != Qundef) {
+        ensure_string_ne(kwvals[NEW_DIR], "invalid new dir type");
+        args->new_dir = StringValueCStr(kwvals[NEW_DIR]);
+    }
+    if (kwvals[MAP_ROOT_USER] != Qundef) args->map_root_user = RTEST(kwvals[MAP_ROOT_USER]);
+    if (kwvals[MAP_CURRENT_USER] != Qundef) args->map_current_user = RTEST(kwvals[MAP_CURRENT_USER]);
+    if (kwvals[MAP_USER] != Qundef) {
+        args->map_user = get_user(StringValueCStr(kwvals[MAP_USER]), _("failed to parse uid"));
+    }
+    if (kwvals[MAP_GROUP] != Qundef) {
+        args->map_group = get_group(StringValueCStr(kwvals[MAP_GROUP]), _("failed to parse gid"));
+    }
+    if (kwvals[KEEP_CAPS] != Qundef) args->keep_caps = RTEST(kwvals[KEEP_CAPS]);
+    if (kwvals[SET_UID] != Qundef) args->set_uid = NUM2UIDT(kwvals[SET_UID]);
+    if (kwvals[SET_GID] != Qundef) args->set_gid = NUM2GIDT(kwvals[SET_GID]);
+    if (kwvals[SET_GROUPS] != Qundef) args->set_groups = setgroups_str2id(StringValueCStr(kwvals[SET_GROUPS]));
+    if (kwvals[PROPAGATION] != Qundef) args->propagation = parse_propagation(StringValueCStr(kwvals[PROPAGATION]));
+    if (kwvals[FORCE_BOOTTIME] != Qundef) args->force_boottime = RTEST(kwvals[FORCE_BOOTTIME]);
+    if (kwvals[FORCE_MONOTONIC] != Qundef) args->force_monotonic = RTEST(kwvals[FORCE_MONOTONIC]);
+    if (kwvals[KILL_CHILD] != Qundef) args->kill_child = RTEST(kwvals[KILL_CHILD]);
+    if ((args->force_monotonic || args->force_boottime) && !args->clone_newtime) {
+        rb_raise(rb_eArgError, "force_monotonic and force_boottime need clone_newtime");
+    }
+    if ((kwvals[MAP_GROUP] != Qundef || args->map_root_user || args->map_current_user) &&
+        args->set_groups == SETGROUPS_ALLOW) {
+        rb_raise(rb_eArgError, "set_groups: \"allow\" and map_group are mutually exclusive");
+    }
+    if (kwvals[UID_MAP] != Qundef) {
+        if (kwvals[MAP_USER] != Qundef || args->map_root_user || args->map_current_user) {
+            rb_raise(rb_eArgError, "uid_map can not be combined with map_*_user");
+        }
+        args->uid_map_len = parse_idmap(kwvals[UID_MAP], args->uid_map, "uid_map");
+    }
+    if (kwvals[GID_MAP] != Qundef) {
+        if (kwvals[MAP_GROUP] != Qundef || args->map_root_user || args->map_current_user) {
+            rb_raise(rb_eArgError, "gid_map can not be combined with map_group");
+        }
+        args->gid_map_len = parse_idmap(kwvals[GID_MAP], args->gid_map, "gid_map");
+    }
+    if (kwvals[TIMINGS] != Qundef) args->timings = RTEST(kwvals[TIMINGS]);
+}
+
+/* a RUnshare::Child for a child of ours, with the timings of its setup if any */
+static VALUE
+child_new(pid_t pid, const struct rb_unshare_timings *t) {
+    VALUE child = rb_funcall(rb_const_get(rb_mRUnshare, id_Child), id_new, 1, PIDT2NUM(pid));
+    VALUE h;
+    int i;
+
+    if (t) {
+        h = rb_hash_new();
+        for (i = 0; i < UNSHARE_PHASE_COUNT; i++) {
+            if (t->ran & (1u << i)) {
+                rb_hash_aset(h, ID2SYM(rb_intern(rb_unshare_phase_name(i))),
+                             DBL2NUM(t->ns[i] / 1e9));
+            }
+        }
+        rb_ivar_set(child, id_timings_iv, rb_hash_freeze(h));
+    }
+
+    return child;
+}
+
+/* waits for child, its RUnshare::Result ends up in Child#status */
+static VALUE
+child_wait(VALUE child) {
+    return rb_funcall(child, id_wait_m, 0);
+}
+
+/* resident bytes of pid from statm, which unlike smaps costs no page walk */
+static VALUE
+statm_rss(pid_t pid) {
+    char path[64], buf[128];
+    unsigned long size, resident;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/statm", (int) pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return Qnil;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return Qnil;
+    }
+    buf[n] = '\0';
+    if (sscanf(buf, "%lu %lu", &size, &resident) != 2) {
+        return Qnil;
+    }
+
+    return ULL2NUM((unsigned long long) resident * sysconf(_SC_PAGESIZE));
+}
+
+/* rb_ractor_main_p() is not public before Ruby 3.4 */
+static bool
+main_ractor_p(void) {
+    return rb_funcall(rb_cRactor, id_current, 0) == rb_funcall(rb_cRactor, id_main, 0);
+}
+
+/* runs parsed unshare options, see RUnshare.unshare */
+static VALUE
+unshare_run(struct rb_unshare_args args) {
+    struct rb_unshare_timings t = { .ran = 0 };
+    const char *step = NULL;
+    VALUE child;
+    int pid;
+
+    /* the child of Process.fork in another Ractor dies in rb_thread_terminate_all */
+    if ((args.fork || args.kill_child) && !main_ractor_p()) {
+        rb_raise(rb_const_get(rb_cRactor, id_UnsafeError),
+                 "fork needs the main Ractor, use spawn or a Spec");
+    }
+
+    /* a process can not map more than its own ids, see spawn */
+    if (args.uid_map_len || args.gid_map_len) {
+        rb_raise(rb_eArgError, "uid_map and gid_map need spawn");
+    }
+    /* they come back on the child handle */
+    if (args.timings && !args.fork) {
+        rb_raise(rb_eArgError, "timings need fork");
+    }
+
+    pid = rb_unshare_internal(args, args.timings ? &t : NULL, &step);
+    if (pid < 0) {
+        unshare_fail(errno, step);
+    }
+    if (pid == 0) {
+        return INT2FIX(0);
+    }
+
+    child = child_new(pid, args.timings ? &t : NULL);
+    /* the base of Child#memory_stats, next to nothing is private yet */
+    rb_ivar_set(child, id_rss_at_fork_iv, statm_rss(pid));
+    if (args.wait) {
+        child_wait(child);
+    }
+
+    return child;
+}
+
+static VALUE
+unshare_run_protected(VALUE data) {
+    return unshare_run(*(struct rb_unshare_args *) data);
+}
+
+static VALUE
+registry_remove(VALUE name) {
+    return rb_funcall(rb_mRegistry, id_remove, 1, name);
+}
+
+/*
+ * RUnshare.unshare(**opts) -> RUnshare::Child or 0
+ *
+ * Unshares the namespaces of opts. With fork, the parent gets the
+ * child as RUnshare::Child (which compares equal to its pid), the
+ * child gets 0.
+ */
 static VALUE
 rb_unshare(int argc, VALUE *argv, VALUE self) {
-    VALUE opt = Qnil;
+    VALUE opt = Qnil, persist = Qnil, entry = Qnil, res, exc;
+    int state;
 
     struct rb_unshare_args args = {
         .set_groups = SETGROUPS_NONE,
@@ -161,101 +470,1509 @@ rb_unshare(int argc, VALUE *argv, VALUE self) {
     rb_scan_args(argc, argv, "0:", &opt);
 
     if (!NIL_P(opt)) {
-        VALUE kwvals[FLAGS_COUNT];
-
-        rb_get_kwargs(opt, rb_unshare_keywords, 0, FLAGS_COUNT, kwvals);
-
-        if (kwvals[CLONE_NEWUSER] != Qundef) args.clone_newuser = RTEST(kwvals[CLONE_NEWUSER]);
-        if (kwvals[CLONE_NEWCGROUP] != Qundef) args.clone_newcgroup = RTEST(kwvals[CLONE_NEWCGROUP]);
-        if (kwvals[CLONE_NEWIPC] != Qundef) args.clone_newipc = RTEST(kwvals[CLONE_NEWIPC]);
-        if (kwvals[CLONE_NEWUTS] != Qundef) args.clone_newuts = RTEST(kwvals[CLONE_NEWUTS]);
-        if (kwvals[CLONE_NEWNET] != Qundef) args.clone_newnet = RTEST(kwvals[CLONE_NEWNET]);
-        if (kwvals[CLONE_NEWPID] != Qundef) args.clone_newpid = RTEST(kwvals[CLONE_NEWPID]);
-        if (kwvals[CLONE_NEWNS] != Qundef) args.clone_newns = RTEST(kwvals[CLONE_NEWNS]);
-        if (kwvals[CLONE_NEWTIME] != Qundef) args.clone_newtime = RTEST(kwvals[CLONE_NEWTIME]);
-        if (kwvals[FORK_ON_CLONE] != Qundef) args.fork = RTEST(kwvals[FORK_ON_CLONE]);
-        if (kwvals[WAIT_FORK] != Qundef) args.wait = RTEST(kwvals[WAIT_FORK]);
-        args.mount_proc = kwvals[MOUNT_PROC];
-        if (args.mount_proc != Qundef) ensure_string_ne(args.mount_proc, "invalid mount type");
-        args.root = kwvals[NEW_ROOT];
-        if (args.root != Qundef) ensure_string_ne(args.root, "invalid root type");
-        args.new_dir = kwvals[NEW_DIR];
-        if (args.new_dir != Qundef) ensure_string_ne(args.new_dir, "invalid new dir type");
-        if (kwvals[MAP_ROOT_USER] != Qundef) args.map_root_user = RTEST(kwvals[MAP_ROOT_USER]);
-        if (kwvals[MAP_CURRENT_USER] != Qundef) args.map_current_user = RTEST(kwvals[MAP_CURRENT_USER]);
-        if (kwvals[MAP_USER] != Qundef) {
-            args.map_user = get_user(StringValueCStr(kwvals[MAP_USER]), _("failed to parse uid"));
+        opt = rb_hash_dup(opt);
+        persist = rb_hash_delete(opt, ID2SYM(id_persist));
+        parse_unshare_args(opt, &args);
+    }
+
+    if (NIL_P(persist)) {
+        res = unshare_run(args);
+        RB_GC_GUARD(opt);
+        return res;
+    }
+
+    /* the registry entry directory to bind the namespaces into */
+    entry = rb_funcall(rb_mRegistry, id_entry, 1, persist);
+    args.persist = StringValueCStr(entry);
+
+    res = rb_protect(unshare_run_protected, (VALUE) &args, &state);
+    if (state) {
+        exc = rb_errinfo();
+        if (NIL_P(exc)) {
+            rb_jump_tag(state);
+        }
+        /* an empty entry of a live owner would keep the name taken */
+        rb_set_errinfo(Qnil);
+        rb_protect(registry_remove, persist, &state);
+        rb_set_errinfo(Qnil);
+        rb_exc_raise(exc);
+    }
+    RB_GC_GUARD(opt);
+    RB_GC_GUARD(persist);
+    RB_GC_GUARD(entry);
+
+    return res;
+}
+
+static int
+spawn_env_i(VALUE key, VALUE val, VALUE envp) {
+    if (NIL_P(val)) {
+        rb_hash_delete(envp, key);
+    } else {
+        rb_hash_aset(envp, key, val);
+    }
+    return ST_CONTINUE;
+}
+
+static int
+spawn_envp_i(VALUE key, VALUE val, VALUE strs) {
+    VALUE str = rb_str_dup(StringValue(key));
+
+    rb_str_cat(str, "=", 1);
+    rb_str_append(str, StringValue(val));
+    StringValueCStr(str);
+    rb_ary_push(strs, str);
+    return ST_CONTINUE;
+}
+
+/* env follows Process.spawn: it is merged into ENV, nil values unset */
+static VALUE
+spawn_env(VALUE env) {
+    VALUE envp = rb_funcall(rb_const_get(rb_cObject, id_ENV), id_to_h, 0);
+    VALUE strs = rb_ary_new();
+
+    rb_hash_foreach(rb_convert_type(env, T_HASH, "Hash", "to_hash"), spawn_env_i, envp);
+    rb_hash_foreach(envp, spawn_envp_i, strs);
+
+    return strs;
+}
+
+/*
+ * The environment of the call as "K=V" strings owned by the caller.
+ * environ itself may be reallocated by ENV writes of other threads
+ * while the child is set up without the GVL.
+ */
+static VALUE
+env_snapshot(void) {
+    VALUE strs = rb_ary_new();
+
+    rb_hash_foreach(rb_funcall(rb_const_get(rb_cObject, id_ENV), id_to_h, 0), spawn_envp_i, strs);
+
+    return strs;
+}
+
+static const struct rb_unshare_nsset *nsset_get(VALUE self);
+static bool nsset_p(VALUE obj);
+
+/* fills buf (RARRAY_LEN(ary) + 1 entries) with the C strings of ary */
+static char **
+cstr_array(VALUE ary, char **buf) {
+    long i, len = RARRAY_LEN(ary);
+
+    for (i = 0; i < len; i++) {
+        buf[i] = RSTRING_PTR(RARRAY_AREF(ary, i));
+    }
+    buf[len] = NULL;
+
+    return buf;
+}
+
+/* a private copy of the command of spawn, with checked strings */
+static VALUE
+spawn_cmd(VALUE cmd) {
+    long i;
+
+    cmd = rb_ary_dup(rb_convert_type(cmd, T_ARRAY, "Array", "to_ary"));
+    if (RARRAY_LEN(cmd) < 1) {
+        rb_raise(rb_eArgError, "empty command");
+    }
+    for (i = 0; i < RARRAY_LEN(cmd); i++) {
+        VALUE arg = rb_str_new_frozen(StringValue(RARRAY_AREF(cmd, i)));
+        StringValueCStr(arg);
+        rb_ary_store(cmd, i, arg);
+    }
+
+    return cmd;
+}
+
+/* argv, env and options of spawn, the caller keeps cmd, envs and nsset alive */
+static void
+spawn_parse(int argc, VALUE *argv, struct rb_unshare_args *args, VALUE *cmd, VALUE *envs,
+            VALUE *nsset) {
+    VALUE opt = Qnil, env = Qnil;
+
+    rb_scan_args(argc, argv, "1:", cmd, &opt);
+
+    *cmd = spawn_cmd(*cmd);
+
+    if (!NIL_P(opt)) {
+        opt = rb_hash_dup(opt);
+        env = rb_hash_delete(opt, ID2SYM(id_env));
+        *nsset = rb_hash_delete(opt, ID2SYM(id_nsset));
+        parse_unshare_args(opt, args);
+    }
+
+    if (!NIL_P(*nsset)) {
+        args->nsset = nsset_get(*nsset);
+    }
+
+    *envs = NIL_P(env) ? Qnil : spawn_env(env);
+}
+
+/*
+ * The clone of spawn and the namespace setup run without the GVL. They
+ * can not be interrupted, so there is no unblocking function. A batch
+ * of count children is started in one go; if one fails, the ones
+ * before it are killed and reaped.
+ */
+struct spawn_nogvl {
+    const struct rb_unshare_args *args;
+    char **argv;
+    char **envp;
+    pid_t *pids;
+    struct rb_unshare_timings *timings;	/* count of them, or NULL */
+    long count;
+
+    long spawned;	/* all of count, or 0 after a failure */
+    const char *step;
+    int err;
+};
+
+static pid_t
+spawn_one(struct spawn_nogvl *ctx, long i) {
+    /* netns acquire swaps clone_newnet for a cached set in the copy */
+    struct rb_unshare_args args = *ctx->args;
+    struct rb_unshare_nsset netns;
+    const char *step;
+    int recycle;
+    pid_t pid;
+
+    recycle = rb_netns_acquire(&args, &netns, &ctx->step);
+    if (recycle < 0) {
+        pid = -1;
+    } else {
+        pid = rb_unshare_spawn_internal(args, ctx->argv, ctx->envp,
+                                        ctx->timings ? &ctx->timings[i] : NULL, &ctx->step);
+    }
+    ctx->err = errno;
+
+    if (recycle > 0) {
+        /* the failed child may have configured it already */
+        if (pid < 0) {
+            rb_netns_recycle(&netns, &step);
+        } else {
+            rb_netns_track(pid, &netns);
+        }
+    }
+
+    return pid;
+}
+
+static void *
+spawn_nogvl(void *data) {
+    struct spawn_nogvl *ctx = data;
+    const char *step;
+    long i, j;
+    int status;
+
+    for (i = 0; i < ctx->count; i++) {
+        ctx->pids[i] = spawn_one(ctx, i);
+        if (ctx->pids[i] < 0) {
+            break;
         }
-        if (kwvals[MAP_GROUP] != Qundef) {
-            args.map_group = get_group(StringValueCStr(kwvals[MAP_GROUP]), _("failed to parse gid"));
+    }
+
+    if (i < ctx->count) {
+        for (j = 0; j < i; j++) {
+            uint64_t m0 = rb_metrics_now();
+
+            kill(ctx->pids[j], SIGKILL);
+            while (waitpid(ctx->pids[j], &status, 0) < 0 && errno == EINTR);
+            rb_metrics_reaped(m0);
+            rb_netns_release(ctx->pids[j], &step);
         }
-        if (kwvals[KEEP_CAPS] != Qundef) args.keep_caps = RTEST(kwvals[KEEP_CAPS]);
-        if (kwvals[SET_UID] != Qundef) args.set_uid = NUM2UIDT(kwvals[SET_UID]);
-        if (kwvals[SET_GID] != Qundef) args.set_gid = NUM2GIDT(kwvals[SET_GID]);
-        if (kwvals[SET_GROUPS] != Qundef) args.set_groups = setgroups_str2id(StringValueCStr(kwvals[SET_GROUPS]));
-        if (kwvals[PROPAGATION] != Qundef) args.propagation = parse_propagation(StringValueCStr(kwvals[PROPAGATION]));
-        if (kwvals[FORCE_BOOTTIME] != Qundef) args.force_boottime = RTEST(kwvals[FORCE_BOOTTIME]);
-        if (kwvals[FORCE_MONOTONIC] != Qundef) args.force_monotonic = RTEST(kwvals[FORCE_MONOTONIC]);
-        if (kwvals[KILL_CHILD] != Qundef) args.kill_child = RTEST(kwvals[KILL_CHILD]);
+        i = 0;
     }
+    ctx->spawned = i;
 
-    return INT2FIX(rb_unshare_internal(args));
+    return NULL;
 }
 
-void
-Init_runshare(void) {
-    rb_mRUnshare = rb_define_module("RUnshare");
-    rb_define_singleton_method(rb_mRUnshare, "unshare", rb_unshare, -1);
+/* spawns cmd with parsed options, the caller keeps the nsset of args alive */
+static VALUE
+spawn_run(struct rb_unshare_args *args, VALUE cmd, VALUE envs) {
+    VALUE vargv, venvp = 0, child;
+    pid_t pid;
+    struct rb_unshare_timings t = { .ran = 0 };
+    struct spawn_nogvl ctx = { .args = args, .pids = &pid, .count = 1 };
 
-    id_clone_newuser = rb_intern("clone_newuser");
-    id_clone_newcgroup = rb_intern("clone_newcgroup");
-    id_clone_newipc = rb_intern("clone_newipc");
-    id_clone_newuts = rb_intern("clone_newuts");
-    id_clone_newnet = rb_intern("clone_newnet");
-    id_clone_newpid = rb_intern("clone_newpid");
-    id_clone_newns = rb_intern("clone_newns");
-    id_clone_newtime = rb_intern("clone_newtime");
-    id_fork = rb_intern("fork");
-    id_wait = rb_intern("wait");
-    id_mount_proc = rb_intern("mount_proc");
-    id_new_root = rb_intern("root");
-    id_new_dir = rb_intern("new_dir");
-    id_map_root_user = rb_intern("map_root_user");
-    id_map_current_user = rb_intern("map_current_user");
-    id_map_user = rb_intern("map_user");
-    id_map_group = rb_intern("map_group");
-    id_keep_caps = rb_intern("keep_caps");
-    id_set_uid = rb_intern("set_uid");
-    id_set_gid = rb_intern("set_gid");
-    id_set_groups = rb_intern("set_groups");
-    id_propagation = rb_intern("propagation");
-    id_force_boottime = rb_intern("force_boottime");
-    id_force_monotonic = rb_intern("force_monotonic");
-    id_kill_child = rb_intern("kill_child");
+    if (args->timings) {
+        ctx.timings = &t;
+    }
+    if (NIL_P(envs)) {
+        envs = env_snapshot();
+    }
 
-    rb_unshare_keywords[CLONE_NEWUSER] = id_clone_newuser;
-    rb_unshare_keywords[CLONE_NEWCGROUP] = id_clone_newcgroup;
-    rb_unshare_keywords[CLONE_NEWIPC] = id_clone_newipc;
-    rb_unshare_keywords[CLONE_NEWUTS] = id_clone_newuts;
-    rb_unshare_keywords[CLONE_NEWNET] = id_clone_newnet;
-    rb_unshare_keywords[CLONE_NEWPID] = id_clone_newpid;
-    rb_unshare_keywords[CLONE_NEWNS] = id_clone_newns;
-    rb_unshare_keywords[CLONE_NEWTIME] = id_clone_newtime;
-    rb_unshare_keywords[FORK_ON_CLONE] = id_fork;
-    rb_unshare_keywords[WAIT_FORK] = id_wait;
-    rb_unshare_keywords[MOUNT_PROC] = id_mount_proc;
-    rb_unshare_keywords[NEW_ROOT] = id_new_root;
-    rb_unshare_keywords[NEW_DIR] = id_new_dir;
-    rb_unshare_keywords[MAP_ROOT_USER] = id_map_root_user;
-    rb_unshare_keywords[MAP_CURRENT_USER] = id_map_current_user;
-    rb_unshare_keywords[MAP_USER] = id_map_user;
-    rb_unshare_keywords[MAP_GROUP] = id_map_group;
-    rb_unshare_keywords[KEEP_CAPS] = id_keep_caps;
-    rb_unshare_keywords[SET_UID] = id_set_uid;
-    rb_unshare_keywords[SET_GID] = id_set_gid;
-    rb_unshare_keywords[SET_GROUPS] = id_set_groups;
-    rb_unshare_keywords[PROPAGATION] = id_propagation;
-    rb_unshare_keywords[FORCE_BOOTTIME] = id_force_boottime;
-    rb_unshare_keywords[FORCE_MONOTONIC] = id_force_monotonic;
-    rb_unshare_keywords[KILL_CHILD] = id_kill_child;
+    ctx.argv = cstr_array(cmd, ALLOCV_N(char *, vargv, RARRAY_LEN(cmd) + 1));
+    ctx.envp = cstr_array(envs, ALLOCV_N(char *, venvp, RARRAY_LEN(envs) + 1));
+
+    /* cmd and envs stay on this stack, so GC keeps them meanwhile */
+    rb_thread_call_without_gvl(spawn_nogvl, &ctx, NULL, NULL);
+
+    ALLOCV_END(vargv);
+    if (venvp) {
+        ALLOCV_END(venvp);
+    }
+    RB_GC_GUARD(cmd);
+    RB_GC_GUARD(envs);
+
+    if (!ctx.spawned) {
+        unshare_fail(ctx.err, ctx.step);
+    }
+
+    /* Child#wait recycles the network namespace */
+    child = child_new(pid, ctx.timings);
+    if (args->wait) {
+        child_wait(child);
+    }
+
+    return child;
+}
+
+static VALUE
+rb_unshare_spawn(int argc, VALUE *argv, VALUE self) {
+    VALUE cmd, envs, nsset = Qnil, res;
+
+    struct rb_unshare_args args = {
+        .set_groups = SETGROUPS_NONE,
+        .map_user = -1,
+        .map_group = -1,
+        .propagation = UNSHARE_PROPAGATION_DEFAULT
+    };
+
+    spawn_parse(argc, argv, &args, &cmd, &envs, &nsset);
+    res = spawn_run(&args, cmd, envs);
+    RB_GC_GUARD(nsset);
+
+    return res;
+}
+
+struct netns_nogvl {
+    pid_t pid;
+
+    int rc;
+    const char *step;
+    int err;
+};
+
+/* flushing a network namespace takes a few round trips to the kernel */
+static void *
+netns_release_nogvl(void *data) {
+    struct netns_nogvl *ctx = data;
+
+    ctx->rc = rb_netns_release(ctx->pid, &ctx->step);
+    ctx->err = errno;
+
+    return NULL;
+}
+
+/*
+ * RUnshare.netns_release(pid) -> nil
+ *
+ * Flushes the network namespace spawn gave to pid and keeps it for
+ * later clone_newnet spawns. Call it once pid has been waited for.
+ */
+static VALUE
+rb_unshare_netns_release(VALUE self, VALUE pid) {
+    struct netns_nogvl ctx = { .pid = NUM2PIDT(pid) };
+
+    rb_thread_call_without_gvl(netns_release_nogvl, &ctx, NULL, NULL);
+    if (ctx.rc < 0) {
+        unshare_fail(ctx.err, ctx.step);
+    }
+
+    return Qnil;
+}
+
+/*
+ * RUnshare.setns(target, user: false, cgroup: false, ipc: false, uts: false,
+ *                net: false, pid: false, mnt: false, time: false) -> nil
+ *
+ * Moves the calling thread into the selected namespaces of target, a
+ * pid, a pidfd IO or a NamespaceSet. pid and time apply to the children
+ * forked afterwards. mnt gives the thread its own root and cwd first.
+ * user is refused by the kernel in a multithreaded process.
+ */
+static VALUE
+rb_unshare_setns(int argc, VALUE *argv, VALUE self) {
+    VALUE target, opt = Qnil, io, kwvals[UNSHARE_NS_COUNT];
+    const char *step = NULL;
+    unsigned int mask = 0;
+    pid_t pid = -1;
+    int pidfd = -1, i;
+
+    rb_scan_args(argc, argv, "1:", &target, &opt);
+
+    if (!NIL_P(opt)) {
+        rb_get_kwargs(opt, setns_keywords, 0, UNSHARE_NS_COUNT, kwvals);
+        for (i = 0; i < UNSHARE_NS_COUNT; i++) {
+            if (kwvals[i] != Qundef && RTEST(kwvals[i])) {
+                mask |= 1U << i;
+            }
+        }
+    }
+    if (!mask) {
+        rb_raise(rb_eArgError, "no namespace given");
+    }
+
+    if (nsset_p(target)) {
+        if (rb_unshare_nsset_enter(nsset_get(target), mask, &step) < 0) {
+            unshare_fail(errno, step);
+        }
+        return Qnil;
+    }
+
+    io = rb_check_convert_type(target, T_FILE, "IO", "to_io");
+    if (NIL_P(io)) {
+        pid = NUM2PIDT(target);
+    } else {
+        pidfd = NUM2INT(rb_funcall(io, id_fileno, 0));
+    }
+
+    if (rb_unshare_setns_internal(pid, pidfd, mask, &step) < 0) {
+        unshare_fail(errno, step);
+    }
+
+    return Qnil;
+}
+
+/*
+ * RUnshare.features -> Hash
+ *
+ * The kernel features found at load time, and under :paths the
+ * mechanism picked for each operation that has several.
+ */
+static VALUE
+rb_unshare_features(VALUE self) {
+    VALUE h = rb_hash_new(), paths = rb_hash_new();
+
+#define FEATURE(name) rb_hash_aset(h, ID2SYM(rb_intern(#name)), rb_features.name ? Qtrue : Qfalse)
+    FEATURE(clone3);
+    FEATURE(pidfd_open);
+    FEATURE(setns_pidfd);
+    FEATURE(mount_api);
+    FEATURE(idmapped_mounts);
+    FEATURE(cgroup2);
+    FEATURE(clone_into_cgroup);
+    FEATURE(time_ns);
+    FEATURE(close_range);
+#undef FEATURE
+
+    rb_hash_aset(paths, ID2SYM(rb_intern("setns")),
+                 ID2SYM(rb_intern(rb_features.setns_pidfd ? "pidfd" : "proc")));
+    rb_hash_aset(paths, ID2SYM(rb_intern("nsset_kill")),
+                 ID2SYM(rb_intern(rb_features.pidfd_open ? "pidfd" : "kill_sleep")));
+    rb_hash_aset(paths, ID2SYM(rb_intern("zygote_close_fds")),
+                 ID2SYM(rb_intern(rb_features.close_range ? "close_range" : "proc")));
+    rb_hash_aset(h, ID2SYM(rb_intern("paths")), rb_obj_freeze(paths));
+
+    return rb_obj_freeze(h);
+}
+
+struct reap_nogvl {
+    pid_t pid;
+
+    pid_t rc;
+    int status;
+    struct rusage ru;
+    int err;
+};
+
+static void *
+reap_nogvl(void *data) {
+    struct reap_nogvl *ctx = data;
+
+    ctx->rc = wait4(ctx->pid, &ctx->status, 0, &ctx->ru);
+    ctx->err = errno;
+    return NULL;
+}
+
+static VALUE
+timeval2dbl(struct timeval tv) {
+    return DBL2NUM(tv.tv_sec + tv.tv_usec / 1e6);
+}
+
+/* RUnshare::Result of a wait4(2) of pid, also left in $? */
+static VALUE
+result_new(pid_t pid, int status, const struct rusage *ru) {
+    VALUE argv[8];
+
+    /* $? as after Process.wait, which also makes the Process::Status */
+    rb_last_status_set(status, pid);
+
+    argv[0] = rb_last_status_get();
+    argv[1] = timeval2dbl(ru->ru_utime);
+    argv[2] = timeval2dbl(ru->ru_stime);
+    argv[3] = LL2NUM((long long) ru->ru_maxrss * 1024);	/* kB */
+    argv[4] = LONG2NUM(ru->ru_minflt);
+    argv[5] = LONG2NUM(ru->ru_majflt);
+    argv[6] = LONG2NUM(ru->ru_nvcsw);
+    argv[7] = LONG2NUM(ru->ru_nivcsw);
+
+    return rb_class_new_instance(8, argv, rb_const_get(rb_mRUnshare, id_Result));
+}
+
+/*
+ * RUnshare.reap(pid) -> RUnshare::Result
+ *
+ * Process.wait2 for a sandbox with wait4(2), which also reports the
+ * resources it used. Unlike the namespace setup, waiting can be
+ * interrupted, so Thread#raise and signals get through. The time spent
+ * waiting and the reaped child count into RUnshare.metrics. Child#wait
+ * reaps with it.
+ */
+static VALUE
+rb_unshare_reap(VALUE self, VALUE pid) {
+    struct reap_nogvl ctx = { .pid = NUM2PIDT(pid) };
+    uint64_t m0 = rb_metrics_now();
+
+    for (;;) {
+        rb_thread_call_without_gvl(reap_nogvl, &ctx, RUBY_UBF_IO, NULL);
+        if (ctx.rc >= 0) {
+            break;
+        }
+        if (ctx.err != EINTR) {
+            rb_syserr_fail(ctx.err, "wait4");
+        }
+        rb_thread_check_ints();
+    }
+    rb_metrics_reaped(m0);
+
+    return result_new(ctx.rc, ctx.status, &ctx.ru);
+}
+
+/* {buckets: {le => cumulative count, ..., Float::INFINITY => count}, sum:, count:} */
+static VALUE
+metrics_histogram(const struct rb_metrics_histogram *m) {
+    VALUE h = rb_hash_new(), buckets = rb_hash_new();
+    int i;
+
+    for (i = 0; i < METRICS_BUCKETS; i++) {
+        VALUE le = DBL2NUM(i < METRICS_BUCKETS - 1 ? rb_metrics_bounds[i] / 1e9 : HUGE_VAL);
+
+        rb_hash_aset(buckets, le, ULL2NUM(m->buckets[i]));
+    }
+    rb_hash_aset(h, ID2SYM(rb_intern("buckets")), rb_obj_freeze(buckets));
+    rb_hash_aset(h, ID2SYM(rb_intern("sum")), DBL2NUM(m->sum_ns / 1e9));
+    rb_hash_aset(h, ID2SYM(rb_intern("count")), ULL2NUM(m->buckets[METRICS_BUCKETS - 1]));
+
+    return rb_obj_freeze(h);
+}
+
+/*
+ * RUnshare.metrics -> Hash
+ *
+ * A snapshot of the sandbox counters of this process: sandboxes
+ * created per set of new namespaces, failures per step and errno,
+ * latency histograms of creation (spawn until execve, unshare with
+ * fork until the child is set up) and of RUnshare.reap, and the
+ * children created and not reaped yet. RUnshare::Metrics renders it
+ * for Prometheus.
+ */
+static VALUE
+rb_unshare_metrics(VALUE self) {
+    struct rb_metrics m;
+    VALUE h = rb_hash_new(), created = rb_hash_new(), failed = rb_hash_new(), create;
+    uint64_t total = 0;
+    int i, j;
+
+    rb_metrics_snapshot(&m);
+
+    for (i = 0; i < METRICS_NS_SETS; i++) {
+        VALUE set;
+
+        if (!m.created[i]) {
+            continue;
+        }
+        set = rb_ary_new();
+        for (j = 0; j < UNSHARE_NS_COUNT; j++) {
+            if (i & (1 << j)) {
+                rb_ary_push(set, ID2SYM(setns_keywords[j]));
+            }
+        }
+        rb_hash_aset(created, rb_obj_freeze(set), ULL2NUM(m.created[i]));
+        total += m.created[i];
+    }
+
+    for (i = 0; i < m.nfailures; i++) {
+        VALUE key = rb_ary_new_from_args(2, m.failures[i].step ?
+                                            rb_str_new_frozen(rb_str_new_cstr(m.failures[i].step)) : Qnil,
+                                         INT2NUM(m.failures[i].err));
+
+        rb_hash_aset(failed, rb_obj_freeze(key), ULL2NUM(m.failures[i].count));
+    }
+
+    create = rb_hash_new();
+    rb_hash_aset(create, ID2SYM(rb_intern("spawn")), metrics_histogram(&m.create[METRICS_PATH_SPAWN]));
+    rb_hash_aset(create, ID2SYM(rb_intern("fork")), metrics_histogram(&m.create[METRICS_PATH_FORK]));
+
+    rb_hash_aset(h, ID2SYM(rb_intern("created")), rb_obj_freeze(created));
+    rb_hash_aset(h, ID2SYM(rb_intern("failed")), rb_obj_freeze(failed));
+    rb_hash_aset(h, ID2SYM(rb_intern("create_seconds")), rb_obj_freeze(create));
+    rb_hash_aset(h, ID2SYM(rb_intern("wait_seconds")), metrics_histogram(&m.wait));
+    rb_hash_aset(h, ID2SYM(rb_intern("live_children")),
+                 LL2NUM(total > m.reaped ? (long long) (total - m.reaped) : 0));
+
+    return rb_obj_freeze(h);
+}
+
+/*
+ * RUnshare.id_cache_ttl -> seconds
+ *
+ * How long user and group names given to map_user and map_group are
+ * remembered after a lookup.
+ */
+static VALUE
+rb_unshare_id_cache_ttl(VALUE self) {
+    return DBL2NUM(rb_idcache_ttl() / 1000.0);
+}
+
+/* RUnshare.id_cache_ttl = seconds, 0 looks up every name again */
+static VALUE
+rb_unshare_set_id_cache_ttl(VALUE self, VALUE ttl) {
+    double sec = NUM2DBL(ttl);
+
+    if (sec < 0) {
+        rb_raise(rb_eArgError, "negative id cache ttl");
+    }
+    rb_idcache_set_ttl((long) (sec * 1000));
+
+    return ttl;
+}
+
+/* RUnshare.id_cache_clear, forgets resolved names after NSS changes */
+static VALUE
+rb_unshare_id_cache_clear(VALUE self) {
+    rb_idcache_clear();
+
+    return Qnil;
+}
+
+static VALUE
+rb_unshare_netns_cache_size(VALUE self) {
+    return INT2NUM(rb_netns_cache_size());
+}
+
+/*
+ * RUnshare.netns_cache_size = n
+ *
+ * Keeps up to n flushed network namespaces for reuse, 0 turns
+ * recycling off.
+ */
+static VALUE
+rb_unshare_netns_set_cache_size(VALUE self, VALUE size) {
+    int n = NUM2INT(size);
+
+    if (n < 0) {
+        rb_raise(rb_eArgError, "negative netns cache size");
+    }
+    if (rb_netns_set_cache_size(n) < 0) {
+        rb_memerror();
+    }
+
+    return size;
+}
+
+static VALUE
+rb_unshare_netns_cached(VALUE self) {
+    return INT2NUM(rb_netns_cached());
+}
+
+struct zygote {
+    int sock;
+    pid_t pid;
+    VALUE lock;
+};
+
+static void
+zygote_mark(void *ptr) {
+    struct zygote *z = ptr;
+
+    rb_gc_mark(z->lock);
+}
+
+static void
+zygote_free(void *ptr) {
+    struct zygote *z = ptr;
+
+    /* the zygote exits on EOF */
+    if (z->sock >= 0) {
+        close(z->sock);
+    }
+    xfree(z);
+}
+
+static size_t
+zygote_memsize(const void *ptr) {
+    return sizeof(struct zygote);
+}
+
+static const rb_data_type_t zygote_type = {
+    "runshare/zygote",
+    { zygote_mark, zygote_free, zygote_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+rb_zygote_alloc(VALUE klass) {
+    struct zygote *z;
+    VALUE obj = TypedData_Make_Struct(klass, struct zygote, &zygote_type, z);
+
+    z->sock = -1;
+    z->lock = Qnil;
+
+    return obj;
+}
+
+static struct zygote *
+zygote_get(VALUE self) {
+    struct zygote *z;
+
+    TypedData_Get_Struct(self, struct zygote, &zygote_type, z);
+    if (z->sock < 0) {
+        rb_raise(rb_eIOError, "closed zygote");
+    }
+
+    return z;
+}
+
+/*
+ * Forks the zygote. Do it early, before the heap grows and threads
+ * are started: the zygote keeps a copy of the process as it is now.
+ */
+static VALUE
+rb_zygote_initialize(VALUE self) {
+    struct zygote *z;
+
+    TypedData_Get_Struct(self, struct zygote, &zygote_type, z);
+    if (z->sock >= 0) {
+        rb_raise(rb_eRuntimeError, "zygote already started");
+    }
+
+    z->pid = rb_zygote_start(&z->sock);
+    if (z->pid < 0) {
+        rb_sys_fail("zygote start");
+    }
+    RB_OBJ_WRITE(self, &z->lock, rb_mutex_new());
+
+    return self;
+}
+
+struct zygote_call {
+    struct zygote *z;
+    pid_t reap;				/* a reap request for it, a spawn if 0 */
+    struct rb_unshare_args *args;
+    char **argv;
+    char **envp;
+    struct zygote_reply reply;
+    int pidfd;
+    bool done;
+};
+
+static VALUE
+zygote_call(VALUE data) {
+    struct zygote_call *c = (struct zygote_call *) data;
+
+    if ((c->reap ? rb_zygote_send_reap(c->z->sock, c->reap) :
+                   rb_zygote_send(c->z->sock, c->args, c->argv, c->envp)) < 0) {
+        rb_sys_fail("zygote send");
+    }
+    rb_thread_wait_fd(c->z->sock);
+    if (rb_zygote_recv(c->z->sock, &c->reply, &c->pidfd) < 0) {
+        rb_sys_fail("zygote recv");
+    }
+    c->done = true;
+
+    return Qnil;
+}
+
+static VALUE
+zygote_call_ensure(VALUE data) {
+    struct zygote_call *c = (struct zygote_call *) data;
+
+    /* an interrupted request leaves the stream out of sync */
+    if (!c->done) {
+        close(c->z->sock);
+        c->z->sock = -1;
+    }
+
+    return Qnil;
+}
+
+static VALUE
+zygote_call_locked(VALUE data) {
+    return rb_ensure(zygote_call, data, zygote_call_ensure, data);
+}
+
+/*
+ * Spawns argv in new namespaces from the zygote. Takes the same
+ * arguments as RUnshare.spawn and returns a RUnshare::Child, whose
+ * wait has the zygote reap the sandbox.
+ */
+static VALUE
+rb_zygote_spawn(int argc, VALUE *argv, VALUE self) {
+    struct zygote *z = zygote_get(self);
+    struct zygote_call c = { .z = z, .pidfd = -1 };
+    VALUE cmd, envs, nsset = Qnil, vargv, venvp = 0, io = Qnil, child;
+    uint64_t m0 = rb_metrics_now();
+
+    struct rb_unshare_args args = {
+        .set_groups = SETGROUPS_NONE,
+        .map_user = -1,
+        .map_group = -1,
+        .propagation = UNSHARE_PROPAGATION_DEFAULT
+    };
+
+    spawn_parse(argc, argv, &args, &cmd, &envs, &nsset);
+    if (args.nsset) {
+        rb_raise(rb_eArgError, "zygote can not enter namespace sets");
+    }
+
+    if (NIL_P(envs)) {
+        envs = env_snapshot();
+    }
+
+    c.args = &args;
+    c.argv = cstr_array(cmd, ALLOCV_N(char *, vargv, RARRAY_LEN(cmd) + 1));
+    c.envp = cstr_array(envs, ALLOCV_N(char *, venvp, RARRAY_LEN(envs) + 1));
+
+    rb_mutex_synchronize(z->lock, zygote_call_locked, (VALUE) &c);
+
+    ALLOCV_END(vargv);
+    if (venvp) {
+        ALLOCV_END(venvp);
+    }
+    RB_GC_GUARD(cmd);
+    RB_GC_GUARD(envs);
+
+    if (c.reply.pid < 0) {
+        /* the step is a copy, the metrics keep static strings only */
+        rb_metrics_failed("zygote spawn failed", c.reply.err ? c.reply.err : EINVAL);
+        unshare_raise(c.reply.err, c.reply.step);
+    }
+    rb_metrics_created(rb_unshare_ns_set(&args), METRICS_PATH_SPAWN, m0);
+
+    if (c.pidfd >= 0) {
+        io = rb_funcall(rb_cIO, id_for_fd, 1, INT2FIX(c.pidfd));
+    }
+    child = rb_funcall(rb_const_get(rb_mRUnshare, id_Child), id_new, 3,
+                       PIDT2NUM(c.reply.pid), io, self);
+    if (args.wait) {
+        child_wait(child);
+    }
+
+    return child;
+}
+
+/*
+ * Zygote#reap(pid) -> RUnshare::Result or nil
+ *
+ * RUnshare.reap for a sandbox of the zygote, which is its parent. Call
+ * it once the pidfd of the sandbox is readable, nil means it still
+ * runs. Child#wait does.
+ */
+static VALUE
+rb_zygote_reap(VALUE self, VALUE pid) {
+    struct zygote *z = zygote_get(self);
+    struct zygote_call c = { .z = z, .reap = NUM2PIDT(pid), .pidfd = -1 };
+    uint64_t m0 = rb_metrics_now();
+
+    if (c.reap <= 0) {
+        rb_raise(rb_eArgError, "invalid pid %d", (int) c.reap);
+    }
+
+    rb_mutex_synchronize(z->lock, zygote_call_locked, (VALUE) &c);
+
+    if (c.reply.pid < 0) {
+        rb_syserr_fail(c.reply.err, c.reply.step);
+    }
+    if (c.reply.pid == 0) {
+        return Qnil;
+    }
+    rb_metrics_reaped(m0);
+
+    return result_new(c.reply.pid, c.reply.status, &c.reply.ru);
+}
+
+static VALUE
+rb_zygote_pid(VALUE self) {
+    struct zygote *z;
+
+    TypedData_Get_Struct(self, struct zygote, &zygote_type, z);
+
+    return PIDT2NUM(z->pid);
+}
+
+/* stops the zygote, already spawned sandboxes keep running */
+static VALUE
+rb_zygote_close(VALUE self) {
+    struct zygote *z;
+    int status;
+
+    TypedData_Get_Struct(self, struct zygote, &zygote_type, z);
+    if (z->sock < 0) {
+        return Qnil;
+    }
+
+    close(z->sock);
+    z->sock = -1;
+    rb_waitpid(z->pid, &status, 0);
+
+    return Qnil;
+}
+
+struct nsset {
+    struct rb_unshare_nsset set;
+    char *scratch;
+};
+
+static void
+nsset_free(void *ptr) {
+    struct nsset *n = ptr;
+
+    rb_unshare_nsset_close(&n->set);
+    xfree(n->scratch);
+    xfree(n);
+}
+
+static size_t
+nsset_memsize(const void *ptr) {
+    return sizeof(struct nsset);
+}
+
+static const rb_data_type_t nsset_type = {
+    "runshare/nsset",
+    { 0, nsset_free, nsset_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+rb_nsset_alloc(VALUE klass) {
+    struct nsset *n;
+    VALUE obj = TypedData_Make_Struct(klass, struct nsset, &nsset_type, n);
+    int i;
+
+    for (i = 0; i < UNSHARE_NS_COUNT; i++) {
+        n->set.fds[i] = -1;
+    }
+
+    return obj;
+}
+
+static bool
+nsset_closed(const struct nsset *n) {
+    int i;
+
+    for (i = 0; i < UNSHARE_NS_COUNT; i++) {
+        if (n->set.fds[i] >= 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static struct nsset *
+nsset_data(VALUE self) {
+    struct nsset *n;
+
+    TypedData_Get_Struct(self, struct nsset, &nsset_type, n);
+    if (nsset_closed(n)) {
+        rb_raise(rb_eIOError, "closed namespace set");
+    }
+
+    return n;
+}
+
+static const struct rb_unshare_nsset *
+nsset_get(VALUE self) {
+    return &nsset_data(self)->set;
+}
+
+static bool
+nsset_p(VALUE obj) {
+    return rb_typeddata_is_kind_of(obj, &nsset_type);
+}
+
+/*
+ * Creating and resetting a set clones helpers and waits for them, which
+ * runs without the GVL and can not be interrupted. A set must not be
+ * closed by another thread meanwhile.
+ */
+struct nsset_nogvl {
+    struct nsset *n;
+    int flags;
+
+    int rc;
+    const char *step;
+    int err;
+};
+
+static void *
+nsset_create_nogvl(void *data) {
+    struct nsset_nogvl *ctx = data;
+
+    ctx->rc = rb_unshare_nsset_create(&ctx->n->set, ctx->flags, ctx->n->scratch, &ctx->step);
+    ctx->err = errno;
+
+    return NULL;
+}
+
+static void *
+nsset_reset_nogvl(void *data) {
+    struct nsset_nogvl *ctx = data;
+
+    ctx->rc = rb_unshare_nsset_reset(&ctx->n->set, ctx->n->scratch, &ctx->step);
+    ctx->err = errno;
+
+    return NULL;
+}
+
+/*
+ * Creates namespaces pinned by open files, without a process living in
+ * them. Takes the clone_new* options of unshare (except pid and time)
+ * and scratch, a directory to mount a fresh tmpfs on in the new mount
+ * namespace.
+ */
+static VALUE
+rb_nsset_initialize(int argc, VALUE *argv, VALUE self) {
+    VALUE opt = Qnil, kwvals[NSSET_FLAGS_COUNT];
+    struct nsset_nogvl ctx;
+    struct nsset *n;
+    int flags;
+
+    struct rb_unshare_args args = {
+        .set_groups = SETGROUPS_NONE,
+        .map_user = -1,
+        .map_group = -1,
+    };
+
+    TypedData_Get_Struct(self, struct nsset, &nsset_type, n);
+
+    rb_scan_args(argc, argv, "0:", &opt);
+    if (!NIL_P(opt)) {
+        rb_get_kwargs(opt, nsset_keywords, 0, NSSET_FLAGS_COUNT, kwvals);
+        if (kwvals[NSSET_CLONE_NEWUSER] != Qundef) args.clone_newuser = RTEST(kwvals[NSSET_CLONE_NEWUSER]);
+        if (kwvals[NSSET_CLONE_NEWCGROUP] != Qundef) args.clone_newcgroup = RTEST(kwvals[NSSET_CLONE_NEWCGROUP]);
+        if (kwvals[NSSET_CLONE_NEWIPC] != Qundef) args.clone_newipc = RTEST(kwvals[NSSET_CLONE_NEWIPC]);
+        if (kwvals[NSSET_CLONE_NEWUTS] != Qundef) args.clone_newuts = RTEST(kwvals[NSSET_CLONE_NEWUTS]);
+        if (kwvals[NSSET_CLONE_NEWNET] != Qundef) args.clone_newnet = RTEST(kwvals[NSSET_CLONE_NEWNET]);
+        if (kwvals[NSSET_CLONE_NEWNS] != Qundef) args.clone_newns = RTEST(kwvals[NSSET_CLONE_NEWNS]);
+        if (kwvals[NSSET_SCRATCH] != Qundef) {
+            ensure_string_ne(kwvals[NSSET_SCRATCH], "invalid scratch type");
+            n->scratch = ruby_strdup(StringValueCStr(kwvals[NSSET_SCRATCH]));
+        }
+    }
+
+    flags = rb_unshare_prepare(&args, geteuid(), getegid());
+    if (!flags) {
+        rb_raise(rb_eArgError, "no namespaces");
+    }
+
+    ctx = (struct nsset_nogvl) { .n = n, .flags = flags };
+    rb_thread_call_without_gvl(nsset_create_nogvl, &ctx, NULL, NULL);
+    if (ctx.rc < 0) {
+        unshare_fail(ctx.err, ctx.step);
+    }
+
+    return self;
+}
+
+/* returns { name => inode } of the pinned namespaces */
+static VALUE
+rb_nsset_inodes(VALUE self) {
+    struct nsset *n = nsset_data(self);
+    VALUE res = rb_hash_new();
+    struct stat st;
+    int i;
+
+    for (i = 0; i < UNSHARE_NS_COUNT; i++) {
+        if (n->set.fds[i] < 0) {
+            continue;
+        }
+        if (fstat(n->set.fds[i], &st) != 0) {
+            rb_sys_fail("fstat");
+        }
+        rb_hash_aset(res, ID2SYM(rb_intern(rb_unshare_ns_name(i))), ULL2NUM(st.st_ino));
+    }
+
+    return res;
+}
+
+/* kills the processes in the namespaces and brings them back to fresh */
+static VALUE
+rb_nsset_reset(VALUE self) {
+    struct nsset_nogvl ctx = { .n = nsset_data(self) };
+
+    rb_thread_call_without_gvl(nsset_reset_nogvl, &ctx, NULL, NULL);
+    if (ctx.rc < 0) {
+        unshare_fail(ctx.err, ctx.step);
+    }
+
+    return self;
+}
+
+static VALUE
+rb_nsset_close(VALUE self) {
+    struct nsset *n;
+
+    TypedData_Get_Struct(self, struct nsset, &nsset_type, n);
+    rb_unshare_nsset_close(&n->set);
+
+    return Qnil;
+}
+
+static VALUE
+rb_nsset_closed_p(VALUE self) {
+    struct nsset *n;
+
+    TypedData_Get_Struct(self, struct nsset, &nsset_type, n);
+
+    return nsset_closed(n) ? Qtrue : Qfalse;
+}
+
+/* binds the namespaces on <dir>/<name>, see RUnshare::Registry */
+static VALUE
+rb_nsset_persist(VALUE self, VALUE dir) {
+    struct nsset *n = nsset_data(self);
+    const char *step = NULL;
+
+    if (rb_unshare_nsset_persist(&n->set, StringValueCStr(dir), &step) < 0) {
+        unshare_fail(errno, step);
+    }
+
+    return self;
+}
+
+/* opens the namespaces bound in dir by NamespaceSet#persist */
+static VALUE
+rb_nsset_s_open(VALUE klass, VALUE dir) {
+    VALUE obj = rb_obj_alloc(klass);
+    struct nsset *n;
+
+    TypedData_Get_Struct(obj, struct nsset, &nsset_type, n);
+    if (rb_unshare_nsset_open(&n->set, StringValueCStr(dir)) < 0) {
+        rb_sys_fail_str(dir);
+    }
+
+    return obj;
+}
+
+static VALUE
+rb_registry_mount_private(VALUE self, VALUE dir) {
+    if (rb_unshare_registry_prepare(StringValueCStr(dir)) < 0) {
+        rb_sys_fail_str(dir);
+    }
+
+    return dir;
+}
+
+static VALUE
+rb_registry_umount(VALUE self, VALUE dir) {
+    if (rb_unshare_unpersist(StringValueCStr(dir)) < 0) {
+        rb_sys_fail_str(dir);
+    }
+
+    return dir;
+}
+
+/* RUnshare.pidfd_open(pid) -> IO */
+static VALUE
+rb_unshare_pidfd_open(VALUE self, VALUE pid) {
+    int fd = pidfd_open(NUM2PIDT(pid), 0);
+
+    if (fd < 0) {
+        rb_sys_fail("pidfd_open");
+    }
+
+    return rb_funcall(rb_cIO, id_for_fd, 1, INT2FIX(fd));
+}
+
+/* RUnshare.pidfd_send_signal(pidfd, signo) -> nil */
+static VALUE
+rb_unshare_pidfd_send_signal(VALUE self, VALUE io, VALUE sig) {
+    int fd = NUM2INT(rb_funcall(io, id_fileno, 0));
+
+    if (pidfd_send_signal(fd, NUM2INT(sig), NULL, 0) < 0) {
+        rb_sys_fail("pidfd_send_signal");
+    }
+
+    return Qnil;
+}
+
+/*
+ * RUnshare::Spec holds unshare options parsed and validated once, with
+ * its own copies of the strings, so unshare and spawn through it skip
+ * the keyword parsing.
+ */
+struct spec {
+    struct rb_unshare_args args;
+    VALUE envs;		/* "K=V" strings, nil for the environment of the call */
+    bool ready;
+};
+
+static void
+spec_mark(void *ptr) {
+    struct spec *sp = ptr;
+
+    rb_gc_mark(sp->envs);
+}
+
+static void
+spec_free(void *ptr) {
+    struct spec *sp = ptr;
+
+    xfree((char *) sp->args.mount_proc);
+    xfree((char *) sp->args.root);
+    xfree((char *) sp->args.new_dir);
+    xfree(sp);
+}
+
+static size_t
+spec_memsize(const void *ptr) {
+    return sizeof(struct spec);
+}
+
+/* frozen once initialized, so Ractors can share it */
+static const rb_data_type_t spec_type = {
+    "runshare/spec",
+    { spec_mark, spec_free, spec_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static VALUE
+rb_spec_alloc(VALUE klass) {
+    struct spec *sp;
+    VALUE obj = TypedData_Make_Struct(klass, struct spec, &spec_type, sp);
+
+    sp->envs = Qnil;
+
+    return obj;
+}
+
+static struct spec *
+spec_get(VALUE self) {
+    struct spec *sp;
+
+    TypedData_Get_Struct(self, struct spec, &spec_type, sp);
+    if (!sp->ready) {
+        rb_raise(rb_eArgError, "uninitialized spec");
+    }
+
+    return sp;
+}
+
+static const char *
+spec_strdup(const char *str) {
+    return str ? ruby_strdup(str) : NULL;
+}
+
+/*
+ * RUnshare::Spec.new(env: nil, **opts)
+ *
+ * Takes the options of RUnshare.unshare and env like RUnshare.spawn.
+ * env is merged into ENV as it is now, not at spawn time.
+ */
+static VALUE
+rb_spec_initialize(int argc, VALUE *argv, VALUE self) {
+    struct spec *sp;
+    VALUE opt = Qnil, env = Qnil;
+    long i;
+
+    struct rb_unshare_args args = {
+        .set_groups = SETGROUPS_NONE,
+        .map_user = -1,
+        .map_group = -1,
+        .propagation = UNSHARE_PROPAGATION_DEFAULT
+    };
+
+    TypedData_Get_Struct(self, struct spec, &spec_type, sp);
+    rb_check_frozen(self);
+
+    rb_scan_args(argc, argv, "0:", &opt);
+    if (!NIL_P(opt)) {
+        opt = rb_hash_dup(opt);
+        env = rb_hash_delete(opt, ID2SYM(id_env));
+        parse_unshare_args(opt, &args);
+    }
+
+    /* validates and resolves the implied options once */
+    rb_unshare_prepare(&args, geteuid(), getegid());
+
+    args.mount_proc = spec_strdup(args.mount_proc);
+    args.root = spec_strdup(args.root);
+    args.new_dir = spec_strdup(args.new_dir);
+    sp->args = args;
+    sp->ready = true;
+
+    if (!NIL_P(env)) {
+        sp->envs = rb_obj_freeze(spawn_env(env));
+        for (i = 0; i < RARRAY_LEN(sp->envs); i++) {
+            rb_obj_freeze(RARRAY_AREF(sp->envs, i));
+        }
+    }
+    RB_GC_GUARD(opt);
+
+    return rb_obj_freeze(self);
+}
+
+/* spec.unshare -> RUnshare::Child or 0, see RUnshare.unshare */
+static VALUE
+rb_spec_unshare(VALUE self) {
+    return unshare_run(spec_get(self)->args);
+}
+
+/*
+ * spec.spawn(cmd, nsset = nil) -> RUnshare::Child
+ *
+ * Like RUnshare.spawn with the options of the spec.
+ */
+static VALUE
+rb_spec_spawn(int argc, VALUE *argv, VALUE self) {
+    struct spec *sp = spec_get(self);
+    struct rb_unshare_args args = sp->args;
+    VALUE cmd, nsset = Qnil, res;
+
+    rb_scan_args(argc, argv, "11", &cmd, &nsset);
+    if (!NIL_P(nsset)) {
+        args.nsset = nsset_get(nsset);
+    }
+
+    res = spawn_run(&args, spawn_cmd(cmd), sp->envs);
+    RB_GC_GUARD(nsset);
+
+    return res;
+}
+
+/*
+ * RUnshare.spawn_many(count, spec, cmd) -> [RUnshare::Child, ...]
+ *
+ * Starts count copies of cmd with the options of spec (a Spec or an
+ * options hash) in a single pass without the GVL. Only the parsing of
+ * the options and the conversion of argv and environment are shared;
+ * every child is set up on its own, id maps, mounts and root included.
+ * If one child can not be started, the ones before it are killed and
+ * the error raised.
+ */
+static VALUE
+rb_unshare_spawn_many(VALUE self, VALUE count, VALUE spec, VALUE cmd) {
+    struct spec *sp;
+    struct spawn_nogvl ctx = { .envp = NULL };
+    VALUE vargv, venvp = 0, vpids, vtimings = 0, children, envs;
+    long n = NUM2LONG(count), i;
+
+    if (n < 0) {
+        rb_raise(rb_eArgError, "negative count");
+    }
+    if (!rb_typeddata_is_kind_of(spec, &spec_type)) {
+        VALUE opt = rb_convert_type(spec, T_HASH, "Hash", "to_hash");
+
+        spec = rb_class_new_instance_kw(1, &opt, rb_cSpec, RB_PASS_KEYWORDS);
+    }
+    sp = spec_get(spec);
+    cmd = spawn_cmd(cmd);
+
+    ctx.args = &sp->args;
+    ctx.count = n;
+    ctx.pids = ALLOCV_N(pid_t, vpids, n ? n : 1);
+    if (sp->args.timings) {
+        ctx.timings = ALLOCV_N(struct rb_unshare_timings, vtimings, n ? n : 1);
+        MEMZERO(ctx.timings, struct rb_unshare_timings, n ? n : 1);
+    }
+    /* one copy of the environment for the whole batch */
+    envs = NIL_P(sp->envs) ? env_snapshot() : sp->envs;
+
+    ctx.argv = cstr_array(cmd, ALLOCV_N(char *, vargv, RARRAY_LEN(cmd) + 1));
+    ctx.envp = cstr_array(envs, ALLOCV_N(char *, venvp, RARRAY_LEN(envs) + 1));
+
+    rb_thread_call_without_gvl(spawn_nogvl, &ctx, NULL, NULL);
+
+    ALLOCV_END(vargv);
+    if (venvp) {
+        ALLOCV_END(venvp);
+    }
+    RB_GC_GUARD(cmd);
+    RB_GC_GUARD(spec);
+    RB_GC_GUARD(envs);
+
+    if (ctx.spawned < n) {
+        ALLOCV_END(vpids);
+        if (vtimings) {
+            ALLOCV_END(vtimings);
+        }
+        unshare_fail(ctx.err, ctx.step);
+    }
+
+    children = rb_ary_new_capa(n);
+    for (i = 0; i < n; i++) {
+        rb_ary_push(children, child_new(ctx.pids[i], ctx.timings ? &ctx.timings[i] : NULL));
+    }
+    ALLOCV_END(vpids);
+    if (vtimings) {
+        ALLOCV_END(vtimings);
+    }
+
+    if (sp->args.wait) {
+        for (i = 0; i < n; i++) {
+            child_wait(RARRAY_AREF(children, i));
+        }
+    }
+
+    return children;
+}
+
+void
+Init_runshare(void) {
+    int i;
+
+    /* per-call state lives on the stack of the call, see unshare.c */
+    rb_ext_ractor_safe(true);
+
+    rb_features_probe();
+
+    id_step = rb_intern("@step");
+    id_errno = rb_intern("errno");
+    exception_init = rb_funcall(rb_eException, rb_intern("instance_method"), 1,
+                                ID2SYM(rb_intern("initialize")));
+    rb_gc_register_mark_object(exception_init);
+
+    rb_mRUnshare = rb_define_module("RUnshare");
+
+    rb_eUnshareError = rb_define_class_under(rb_mRUnshare, "Error", rb_eSystemCallError);
+    rb_define_method(rb_eUnshareError, "initialize", rb_unshare_error_initialize, 2);
+    rb_define_singleton_method(rb_eUnshareError, "===", rb_unshare_error_eqq, 1);
+    rb_define_attr(rb_eUnshareError, "step", 1, 0);
+    rb_define_singleton_method(rb_mRUnshare, "unshare", rb_unshare, -1);
+    rb_define_singleton_method(rb_mRUnshare, "spawn", rb_unshare_spawn, -1);
+    rb_define_singleton_method(rb_mRUnshare, "spawn_many", rb_unshare_spawn_many, 3);
+    rb_define_singleton_method(rb_mRUnshare, "setns", rb_unshare_setns, -1);
+    rb_define_singleton_method(rb_mRUnshare, "pidfd_open", rb_unshare_pidfd_open, 1);
+    rb_define_singleton_method(rb_mRUnshare, "pidfd_send_signal", rb_unshare_pidfd_send_signal, 2);
+    rb_define_singleton_method(rb_mRUnshare, "netns_release", rb_unshare_netns_release, 1);
+    rb_define_singleton_method(rb_mRUnshare, "features", rb_unshare_features, 0);
+    rb_define_singleton_method(rb_mRUnshare, "metrics", rb_unshare_metrics, 0);
+    rb_define_singleton_method(rb_mRUnshare, "reap", rb_unshare_reap, 1);
+    rb_define_singleton_method(rb_mRUnshare, "id_cache_ttl", rb_unshare_id_cache_ttl, 0);
+    rb_define_singleton_method(rb_mRUnshare, "id_cache_ttl=", rb_unshare_set_id_cache_ttl, 1);
+    rb_define_singleton_method(rb_mRUnshare, "id_cache_clear", rb_unshare_id_cache_clear, 0);
+    rb_define_singleton_method(rb_mRUnshare, "netns_cache_size", rb_unshare_netns_cache_size, 0);
+    rb_define_singleton_method(rb_mRUnshare, "netns_cache_size=", rb_unshare_netns_set_cache_size, 1);
+    rb_define_singleton_method(rb_mRUnshare, "netns_cached", rb_unshare_netns_cached, 0);
+
+    rb_cZygote = rb_define_class_under(rb_mRUnshare, "Zygote", rb_cObject);
+    rb_define_alloc_func(rb_cZygote, rb_zygote_alloc);
+    rb_define_method(rb_cZygote, "initialize", rb_zygote_initialize, 0);
+    rb_define_method(rb_cZygote, "spawn", rb_zygote_spawn, -1);
+    rb_define_method(rb_cZygote, "reap", rb_zygote_reap, 1);
+    rb_define_method(rb_cZygote, "pid", rb_zygote_pid, 0);
+    rb_define_method(rb_cZygote, "close", rb_zygote_close, 0);
+
+    rb_cNamespaceSet = rb_define_class_under(rb_mRUnshare, "NamespaceSet", rb_cObject);
+    rb_define_alloc_func(rb_cNamespaceSet, rb_nsset_alloc);
+    rb_define_method(rb_cNamespaceSet, "initialize", rb_nsset_initialize, -1);
+    rb_define_method(rb_cNamespaceSet, "inodes", rb_nsset_inodes, 0);
+    rb_define_method(rb_cNamespaceSet, "reset", rb_nsset_reset, 0);
+    rb_define_method(rb_cNamespaceSet, "close", rb_nsset_close, 0);
+    rb_define_method(rb_cNamespaceSet, "closed?", rb_nsset_closed_p, 0);
+    rb_define_method(rb_cNamespaceSet, "persist", rb_nsset_persist, 1);
+    rb_define_singleton_method(rb_cNamespaceSet, "open", rb_nsset_s_open, 1);
+
+    rb_cSpec = rb_define_class_under(rb_mRUnshare, "Spec", rb_cObject);
+    rb_define_alloc_func(rb_cSpec, rb_spec_alloc);
+    rb_define_method(rb_cSpec, "initialize", rb_spec_initialize, -1);
+    rb_define_method(rb_cSpec, "unshare", rb_spec_unshare, 0);
+    rb_define_method(rb_cSpec, "spawn", rb_spec_spawn, -1);
+
+    rb_mRegistry = rb_define_module_under(rb_mRUnshare, "Registry");
+    rb_define_singleton_method(rb_mRegistry, "mount_private", rb_registry_mount_private, 1);
+    rb_define_singleton_method(rb_mRegistry, "umount", rb_registry_umount, 1);
+
+    id_clone_newuser = rb_intern("clone_newuser");
+    id_clone_newcgroup = rb_intern("clone_newcgroup");
+    id_clone_newipc = rb_intern("clone_newipc");
+    id_clone_newuts = rb_intern("clone_newuts");
+    id_clone_newnet = rb_intern("clone_newnet");
+    id_clone_newpid = rb_intern("clone_newpid");
+    id_clone_newns = rb_intern("clone_newns");
+    id_clone_newtime = rb_intern("clone_newtime");
+    id_fork = rb_intern("fork");
+    id_wait = rb_intern("wait");
+    id_mount_proc = rb_intern("mount_proc");
+    id_new_root = rb_intern("root");
+    id_new_dir = rb_intern("new_dir");
+    id_map_root_user = rb_intern("map_root_user");
+    id_map_current_user = rb_intern("map_current_user");
+    id_map_user = rb_intern("map_user");
+    id_map_group = rb_intern("map_group");
+    id_keep_caps = rb_intern("keep_caps");
+    id_set_uid = rb_intern("set_uid");
+    id_set_gid = rb_intern("set_gid");
+    id_set_groups = rb_intern("set_groups");
+    id_propagation = rb_intern("propagation");
+    id_force_boottime = rb_intern("force_boottime");
+    id_force_monotonic = rb_intern("force_monotonic");
+    id_kill_child = rb_intern("kill_child");
+    id_uid_map = rb_intern("uid_map");
+    id_gid_map = rb_intern("gid_map");
+    id_timings = rb_intern("timings");
+    for (i = 0; i < UNSHARE_NS_COUNT; i++) {
+        setns_keywords[i] = rb_intern(setns_names[i]);
+    }
+
+    id_env = rb_intern("env");
+    id_ENV = rb_intern("ENV");
+    id_to_h = rb_intern("to_h");
+    id_for_fd = rb_intern("for_fd");
+    id_fileno = rb_intern("fileno");
+    id_nsset = rb_intern("nsset");
+    id_scratch = rb_intern("scratch");
+    id_persist = rb_intern("persist");
+    id_entry = rb_intern("entry");
+    id_remove = rb_intern("remove");
+    id_current = rb_intern("current");
+    id_main = rb_intern("main");
+    id_UnsafeError = rb_intern("UnsafeError");
+    id_Child = rb_intern("Child");
+    id_Result = rb_intern("Result");
+    id_timings_iv = rb_intern("@timings");
+    id_rss_at_fork_iv = rb_intern("@rss_at_fork");
+    id_new = rb_intern("new");
+    id_wait_m = rb_intern("wait");
+
+    rb_unshare_keywords[CLONE_NEWUSER] = id_clone_newuser;
+    rb_unshare_keywords[CLONE_NEWCGROUP] = id_clone_newcgroup;
+    rb_unshare_keywords[CLONE_NEWIPC] = id_clone_newipc;
+    rb_unshare_keywords[CLONE_NEWUTS] = id_clone_newuts;
+    rb_unshare_keywords[CLONE_NEWNET] = id_clone_newnet;
+    rb_unshare_keywords[CLONE_NEWPID] = id_clone_newpid;
+    rb_unshare_keywords[CLONE_NEWNS] = id_clone_newns;
+    rb_unshare_keywords[CLONE_NEWTIME] = id_clone_newtime;
+    rb_unshare_keywords[FORK_ON_CLONE] = id_fork;
+    rb_unshare_keywords[WAIT_FORK] = id_wait;
+    rb_unshare_keywords[MOUNT_PROC] = id_mount_proc;
+    rb_unshare_keywords[NEW_ROOT] = id_new_root;
+    rb_unshare_keywords[NEW_DIR] = id_new_dir;
+    rb_unshare_keywords[MAP_ROOT_USER] = id_map_root_user;
+    rb_unshare_keywords[MAP_CURRENT_USER] = id_map_current_user;
+    rb_unshare_keywords[MAP_USER] = id_map_user;
+    rb_unshare_keywords[MAP_GROUP] = id_map_group;
+    rb_unshare_keywords[KEEP_CAPS] = id_keep_caps;
+    rb_unshare_keywords[SET_UID] = id_set_uid;
+    rb_unshare_keywords[SET_GID] = id_set_gid;
+    rb_unshare_keywords[SET_GROUPS] = id_set_groups;
+    rb_unshare_keywords[PROPAGATION] = id_propagation;
+    rb_unshare_keywords[FORCE_BOOTTIME] = id_force_boottime;
+    rb_unshare_keywords[FORCE_MONOTONIC] = id_force_monotonic;
+    rb_unshare_keywords[KILL_CHILD] = id_kill_child;
+    rb_unshare_keywords[UID_MAP] = id_uid_map;
+    rb_unshare_keywords[GID_MAP] = id_gid_map;
+    rb_unshare_keywords[TIMINGS] = id_timings;
+
+    nsset_keywords[NSSET_CLONE_NEWUSER] = id_clone_newuser;
+    nsset_keywords[NSSET_CLONE_NEWCGROUP] = id_clone_newcgroup;
+    nsset_keywords[NSSET_CLONE_NEWIPC] = id_clone_newipc;
+    nsset_keywords[NSSET_CLONE_NEWUTS] = id_clone_newuts;
+    nsset_keywords[NSSET_CLONE_NEWNET] = id_clone_newnet;
+    nsset_keywords[NSSET_CLONE_NEWNS] = id_clone_newns;
+    nsset_keywords[NSSET_SCRATCH] = id_scratch;
 }
\ No newline at end of file
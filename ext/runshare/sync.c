@@ -0,0 +1,159 @@
+/*
+ * Parent/child handoffs. read_all() and write_all() of all-io.h back
+ * off for 250 ms on EINTR/EAGAIN, so a single signal arriving at the
+ * wrong moment shows up in the sandbox startup time. These helpers
+ * wait in poll() against a deadline and restart it right away when a
+ * signal interrupts. Everything here is async-signal-safe and can run
+ * in a CLONE_VM child; timeouts are in milliseconds, -1 waits forever.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sync.h"
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static long long deadline_of(int timeout_ms)
+{
+    return timeout_ms < 0 ? -1 : now_ms() + timeout_ms;
+}
+
+/*
+ * Waits for events on fd until deadline. Returns 0 once fd is ready (or
+ * has hung up, left to the caller to notice), -1 with errno ETIMEDOUT
+ * or the poll() error.
+ */
+static int poll_until(int fd, short events, long long deadline)
+{
+    struct pollfd p = { .fd = fd, .events = events };
+    long long left;
+    int n;
+
+    for (;;) {
+        left = deadline < 0 ? -1 : deadline - now_ms();
+        if (deadline >= 0 && left < 0)
+            left = 0;
+
+        n = poll(&p, 1, (int) left);
+        if (n > 0)
+            return 0;
+        if (n == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+int rb_sync_event_open(struct rb_sync_event *ev)
+{
+    ev->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    return ev->fd < 0 ? -1 : 0;
+}
+
+int rb_sync_event_signal(struct rb_sync_event *ev)
+{
+    uint64_t one = 1;
+    ssize_t n;
+
+    do {
+        n = write(ev->fd, &one, sizeof(one));
+    } while (n < 0 && errno == EINTR);
+
+    return n == sizeof(one) ? 0 : -1;
+}
+
+int rb_sync_event_wait(struct rb_sync_event *ev, int timeout_ms)
+{
+    long long deadline = deadline_of(timeout_ms);
+    uint64_t val;
+    ssize_t n;
+
+    for (;;) {
+        n = read(ev->fd, &val, sizeof(val));
+        if (n == sizeof(val))
+            return 0;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno != EAGAIN)
+            return -1;
+        if (poll_until(ev->fd, POLLIN, deadline) < 0)
+            return -1;
+    }
+}
+
+void rb_sync_event_close(struct rb_sync_event *ev)
+{
+    if (ev->fd >= 0)
+        close(ev->fd);
+    ev->fd = -1;
+}
+
+/* a pidfd turns readable when its process has exited */
+int rb_sync_wait_exit(int pidfd, int timeout_ms)
+{
+    return poll_until(pidfd, POLLIN, deadline_of(timeout_ms));
+}
+
+/*
+ * Reads count bytes, or less on EOF. Returns the number read, or -1
+ * with errno set if nothing could be read.
+ */
+ssize_t rb_sync_read(int fd, void *buf, size_t count, int timeout_ms)
+{
+    long long deadline = deadline_of(timeout_ms);
+    char *p = buf;
+    ssize_t c = 0, n;
+
+    while (count > 0) {
+        if (poll_until(fd, POLLIN, deadline) < 0)
+            return c ? c : -1;
+
+        n = read(fd, p, count);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return c ? c : -1;
+        }
+        if (n == 0)
+            return c;
+        count -= n;
+        p += n;
+        c += n;
+    }
+    return c;
+}
+
+int rb_sync_write(int fd, const void *buf, size_t count, int timeout_ms)
+{
+    long long deadline = deadline_of(timeout_ms);
+    const char *p = buf;
+    ssize_t n;
+
+    while (count > 0) {
+        if (poll_until(fd, POLLOUT, deadline) < 0)
+            return -1;
+
+        n = write(fd, p, count);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        count -= n;
+        p += n;
+    }
+    return 0;
+}
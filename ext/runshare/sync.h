@@ -0,0 +1,23 @@
+#ifndef SYNC_H
+#define SYNC_H 1
+
+#include <sys/types.h>
+
+/* how long a parent/child handoff may take before it counts as lost */
+#define SYNC_TIMEOUT_MS		10000
+
+/* one-shot wakeup between processes sharing the fd (fork or clone) */
+struct rb_sync_event {
+    int fd;
+};
+
+int rb_sync_event_open(struct rb_sync_event *ev);
+int rb_sync_event_signal(struct rb_sync_event *ev);
+int rb_sync_event_wait(struct rb_sync_event *ev, int timeout_ms);
+void rb_sync_event_close(struct rb_sync_event *ev);
+
+int rb_sync_wait_exit(int pidfd, int timeout_ms);
+ssize_t rb_sync_read(int fd, void *buf, size_t count, int timeout_ms);
+int rb_sync_write(int fd, const void *buf, size_t count, int timeout_ms);
+
+#endif
@@ -18,31 +18,47 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <dirent.h>
 #include <errno.h>
 #include <grp.h>
+#include <pthread.h>
 #include <ruby.h>
+#include <ruby/thread.h>
 #include <sched.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/ipc.h>
 #include <sys/mount.h>
+#include <sys/msg.h>
 #include <sys/prctl.h>
+#include <sys/sem.h>
+#include <sys/shm.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "include/c.h"
 #include "include/caputils.h"
 #include "include/namespace.h"
 #include "include/pathnames.h"
-#include "include/all-io.h"
+#include "include/pidfd-utils.h"
 
+#include "kfeatures.h"
+#include "metrics.h"
+#include "netns.h"
+#include "probes.h"
+#include "sync.h"
 #include "unshare.h"
 
-/* /proc namespace files and mountpoints for binds */
-static struct namespace_file {
+RUNSHARE_PROBE_SEMAPHORES
+
+/* /proc namespace files */
+static const struct namespace_file {
     int		type;		/* CLONE_NEW* */
     const char	*name;		/* ns/<type> */
-    const char	*target;	/* user specified target for bind mount */
 } namespace_files[] = {
     { .type = CLONE_NEWUSER,  .name = "ns/user" },
     { .type = CLONE_NEWCGROUP,.name = "ns/cgroup" },
@@ -55,88 +71,201 @@ static struct namespace_file {
     { .name = NULL }
 };
 
-static int npersists = 0;	/* number of persistent namespaces */
+/*
+ * Bind mount targets of one unshare call, indexed like namespace_files.
+ * Kept by the caller, calls from several threads never share them.
+ */
+struct ns_targets {
+    const char *target[UNSHARE_NS_COUNT];	/* user specified target for bind mount */
+    char paths[UNSHARE_NS_COUNT][PATH_MAX];	/* backing store of persist_ns_targets() */
+    int count;					/* number of persistent namespaces */
+};
+
+static const char *const phase_names[UNSHARE_PHASE_COUNT] = {
+    [UNSHARE_PHASE_TOTAL]	= "total",
+    [UNSHARE_PHASE_HELPER]	= "helper",
+    [UNSHARE_PHASE_UNSHARE]	= "unshare",
+    [UNSHARE_PHASE_CLONE]	= "clone",
+    [UNSHARE_PHASE_FORK]	= "fork",
+    [UNSHARE_PHASE_BIND]	= "bind",
+    [UNSHARE_PHASE_IDMAP]	= "idmap",
+    [UNSHARE_PHASE_SETNS]	= "setns",
+    [UNSHARE_PHASE_MAP_ID]	= "map_id",
+    [UNSHARE_PHASE_SETGROUPS]	= "setgroups",
+    [UNSHARE_PHASE_PROPAGATION]	= "propagation",
+    [UNSHARE_PHASE_CHROOT]	= "chroot",
+    [UNSHARE_PHASE_MOUNT_PROC]	= "mount_proc",
+    [UNSHARE_PHASE_CREDENTIALS]	= "credentials",
+    [UNSHARE_PHASE_CAPS]	= "caps",
+    [UNSHARE_PHASE_EXEC]	= "exec",
+};
+
+const char *rb_unshare_phase_name(int phase)
+{
+    return phase_names[phase];
+}
+
+/*
+ * Phase timings are taken only when the caller passes t. The clock is a
+ * vDSO call and async-signal-safe, so the CLONE_VM child takes them too;
+ * phases that run several times or in pieces add up.
+ */
+static uint64_t timing_now(const struct rb_unshare_timings *t)
+{
+    struct timespec ts;
+
+    if (!t)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void timing_add(struct rb_unshare_timings *t, int phase, uint64_t since)
+{
+    if (!t)
+        return;
+    t->ns[phase] += timing_now(t) - since;
+    t->ran |= 1u << phase;
+}
+
+/* bit i set for namespace_files[i] in flags, the key of the created counters */
+static unsigned int ns_set(int flags)
+{
+    unsigned int set = 0;
+    int i;
+
+    for (i = 0; namespace_files[i].name; i++) {
+        if (flags & namespace_files[i].type)
+            set |= 1u << i;
+    }
+
+    return set;
+}
+
+/* room for the child setup and execvpe() path search */
+#define CLONE_STACK_SIZE	(256 * 1024)
 
-static void setgroups_control(int action)
+/*
+ * The helpers below run in the child between unshare/clone and the
+ * return to ruby (or execve). They may run on a CLONE_VM stack, so they
+ * never allocate and report failures with -1 and errno instead of exiting.
+ */
+static int setgroups_control(int action)
 {
     const char *file = _PATH_PROC_SETGROUPS;
     const char *cmd;
-    int fd;
+    int fd, rc = 0;
 
     if (action < 0 || (size_t) action >= ARRAY_SIZE(setgroups_strings))
-        return;
+        return 0;
     cmd = setgroups_strings[action];
 
-    fd = open(file, O_WRONLY);
-    if (fd < 0) {
-        if (errno == ENOENT)
-            return;
-        err(EXIT_FAILURE, _("cannot open %s"), file);
-    }
+    fd = open(file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
 
-    if (write_all(fd, cmd, strlen(cmd)))
-        err(EXIT_FAILURE, _("write failed %s"), file);
+    /* proc files take a single write */
+    if (write(fd, cmd, strlen(cmd)) != (ssize_t) strlen(cmd))
+        rc = -1;
     close(fd);
+    return rc;
 }
 
-static void map_id(const char *file, uint32_t from, uint32_t to)
+static int map_id(const char *file, uint32_t from, uint32_t to)
 {
-    char *buf;
-    int fd;
+    char buf[sizeof(stringify_value(UINT32_MAX)) * 2 + 3];
+    int fd, len, rc = 0;
+    uint64_t p0 = probe_now(map_id);
 
-    fd = open(file, O_WRONLY);
-    if (fd < 0)
-        err(EXIT_FAILURE, _("cannot open %s"), file);
+    fd = open(file, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        RUNSHARE_PROBE(map_id, from, 0, errno, p0);
+        return -1;
+    }
 
-    xasprintf(&buf, "%u %u 1", from, to);
-    if (write_all(fd, buf, strlen(buf)))
-        err(EXIT_FAILURE, _("write failed %s"), file);
-    free(buf);
+    len = snprintf(buf, sizeof(buf), "%u %u 1", from, to);
+    if (write(fd, buf, len) != len)
+        rc = -1;
+    RUNSHARE_PROBE(map_id, from, 0, rc ? errno : 0, p0);
     close(fd);
+    return rc;
 }
 
-static void set_propagation(unsigned long flags)
+static int set_propagation(unsigned long flags)
 {
+    uint64_t p0 = probe_now(mount_propagation);
+    int rc;
+
     if (flags == 0)
-        return;
+        return 0;
 
-    if (mount("none", "/", NULL, flags, NULL) != 0)
-        err(EXIT_FAILURE, _("cannot change root filesystem propagation"));
+    rc = mount("none", "/", NULL, flags, NULL);
+    RUNSHARE_PROBE(mount_propagation, flags, 0, rc ? errno : 0, p0);
+    return rc;
 }
 
-static int set_ns_target(int type, const char *path)
+static int set_ns_target(struct ns_targets *t, int type, const char *path)
 {
-    struct namespace_file *ns;
+    int i;
 
-    for (ns = namespace_files; ns->name; ns++) {
-        if (ns->type != type)
+    for (i = 0; namespace_files[i].name; i++) {
+        if (namespace_files[i].type != type)
             continue;
-        ns->target = path;
-        npersists++;
+        t->target[i] = path;
+        t->count++;
         return 0;
     }
 
     return -EINVAL;
 }
 
-static int bind_ns_files(pid_t pid)
+/*
+ * Sets <dir>/<name> as the bind target of every namespace in flags,
+ * creating the empty files to mount on.
+ */
+static int persist_ns_targets(struct ns_targets *t, const char *dir, int flags)
+{
+    int i, fd;
+
+    for (i = 0; namespace_files[i].name; i++) {
+        if (!(flags & namespace_files[i].type))
+            continue;
+
+        snprintf(t->paths[i], PATH_MAX, "%s/%s", dir, rb_unshare_ns_name(i));
+        fd = open(t->paths[i], O_WRONLY | O_CREAT | O_CLOEXEC, 0444);
+        if (fd < 0)
+            return -1;
+        close(fd);
+        set_ns_target(t, namespace_files[i].type, t->paths[i]);
+    }
+
+    return 0;
+}
+
+/* may run in the CLONE_VM helper, so no err() here */
+static int bind_ns_files(const struct ns_targets *t, pid_t pid)
 {
-    struct namespace_file *ns;
     char src[PATH_MAX];
+    uint64_t p0;
+    int i, rc;
 
-    for (ns = namespace_files; ns->name; ns++) {
-        if (!ns->target)
+    for (i = 0; namespace_files[i].name; i++) {
+        if (!t->target[i])
             continue;
 
-        snprintf(src, sizeof(src), "/proc/%u/%s", (unsigned) pid, ns->name);
+        snprintf(src, sizeof(src), "/proc/%u/%s", (unsigned) pid, namespace_files[i].name);
 
-        if (mount(src, ns->target, NULL, MS_BIND, NULL) != 0)
-            err(EXIT_FAILURE, _("mount %s on %s failed"), src, ns->target);
+        p0 = probe_now(mount_bind);
+        rc = mount(src, t->target[i], NULL, MS_BIND, NULL);
+        RUNSHARE_PROBE(mount_bind, namespace_files[i].type, pid, rc ? errno : 0, p0);
+        if (rc != 0)
+            return -1;
     }
 
     return 0;
 }
 
+/* 0 on failure */
 static ino_t get_mnt_ino(pid_t pid)
 {
     struct stat st;
@@ -145,322 +274,337 @@ static ino_t get_mnt_ino(pid_t pid)
     snprintf(path, sizeof(path), "/proc/%u/ns/mnt", (unsigned) pid);
 
     if (stat(path, &st) != 0)
-        err(EXIT_FAILURE, _("stat of %s failed"), path);
+        return 0;
     return st.st_ino;
 }
 
-static void settime(time_t offset, clockid_t clk_id)
+static int settime(time_t offset, clockid_t clk_id)
 {
     char buf[sizeof(stringify_value(ULONG_MAX)) * 3];
-    int fd, len;
+    int fd, len, rc = 0;
+    uint64_t p0 = probe_now(settime);
 
     len = snprintf(buf, sizeof(buf), "%d %ld 0", clk_id, offset);
 
-    fd = open("/proc/self/timens_offsets", O_WRONLY);
-    if (fd < 0)
-        err(EXIT_FAILURE, _("failed to open /proc/self/timens_offsets"));
+    fd = open("/proc/self/timens_offsets", O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        RUNSHARE_PROBE(settime, clk_id, 0, errno, p0);
+        return -1;
+    }
 
     if (write(fd, buf, len) != len)
-        err(EXIT_FAILURE, _("failed to write to /proc/self/timens_offsets"));
+        rc = -1;
+    RUNSHARE_PROBE(settime, clk_id, 0, rc ? errno : 0, p0);
 
     close(fd);
+    return rc;
 }
 
-static void bind_ns_files_from_child(pid_t *child, int fds[2])
-{
-    char ch;
-    pid_t ppid = getpid();
-    ino_t ino = get_mnt_ino(ppid);
-
-    if (pipe(fds) < 0)
-        err(EXIT_FAILURE, _("pipe failed"));
-
-    *child = fork();
-
-    switch (*child) {
-        case -1:
-            err(EXIT_FAILURE, _("fork failed"));
-
-        case 0:	/* child */
-            close(fds[1]);
-            fds[1] = -1;
+/* shared with the helper of bind_ns_files_from_child() */
+struct bind_ctx {
+    const struct ns_targets *targets;
+    pid_t ppid;
+    ino_t ino;
+    struct rb_sync_event ready;
+    void *stack;
+    int err;	/* set by the helper before it exits, its only result */
+};
 
-            /* wait for parent */
-            if (read_all(fds[0], &ch, 1) != 1 && ch != PIPE_SYNC_BYTE)
-                err(EXIT_FAILURE, _("failed to read pipe"));
-            if (get_mnt_ino(ppid) == ino)
-                exit(EXIT_FAILURE);
-            bind_ns_files(ppid);
-            exit(EXIT_SUCCESS);
-            break;
+/*
+ * Stays in the old mount namespace and binds the new namespaces of the
+ * parent once it has unshared them. Shares the parent's memory, so it
+ * must stay async-signal-safe; all signals are blocked in it. Without
+ * CLONE_SETTLS it also shares the TLS of the parent thread, errno
+ * included, and runs while the parent waits for it: it reports in
+ * ctx->err only, and the parent ignores errno until it has reaped it.
+ */
+static int bind_helper(void *data)
+{
+    struct bind_ctx *ctx = data;
 
-        default: /* parent */
-            close(fds[0]);
-            fds[0] = -1;
-            break;
+    /* wait for parent */
+    if (rb_sync_event_wait(&ctx->ready, SYNC_TIMEOUT_MS) != 0) {
+        ctx->err = errno ?: EIO;
+        _exit(EXIT_FAILURE);
+    }
+    if (get_mnt_ino(ctx->ppid) == ctx->ino) {
+        ctx->err = EINVAL;
+        _exit(EXIT_FAILURE);
     }
+    if (bind_ns_files(ctx->targets, ctx->ppid) != 0) {
+        ctx->err = errno ?: EIO;
+        _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_SUCCESS);
 }
 
-int rb_unshare_internal(struct rb_unshare_args args)
+/*
+ * Unlike unshare(1) the helper is not forked: duplicating the page
+ * tables of a big ruby heap just to call mount() is too expensive, it
+ * runs on a small stack in our address space instead (CLONE_VM without
+ * CLONE_VFORK, as it has to wait for us).
+ */
+static int bind_ns_files_from_child(pid_t *child, struct bind_ctx *ctx, const char **step)
 {
-    int unshare_flags = 0;
+    sigset_t all, old;
+    uint64_t p0 = probe_now(bind_helper);
+    int e;
+
+    ctx->ppid = getpid();
+    ctx->ino = get_mnt_ino(ctx->ppid);
+    if (!ctx->ino) {
+        *step = _("stat of mount namespace failed");
+        return -1;
+    }
 
-    // int kill_child_signo = 0; /* 0 means --kill-child was not used */
-    char *procmnt = NULL;
-    char *newroot = NULL;
-    char *newdir = NULL;
+    if (rb_sync_event_open(&ctx->ready) < 0) {
+        *step = _("eventfd failed");
+        return -1;
+    }
 
-    int fds[2];
-    int status;
+    ctx->stack = mmap(NULL, CLONE_STACK_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (ctx->stack == MAP_FAILED) {
+        *step = _("mmap failed");
+        goto fail;
+    }
 
-    int pid_bind = 0;
-    int pid = 0;
+    /* the helper keeps the full mask, no ruby handler may run on its stack */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    *child = clone(bind_helper, (char *) ctx->stack + CLONE_STACK_SIZE,
+                   CLONE_VM | SIGCHLD, ctx);
+    e = errno;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    RUNSHARE_PROBE(bind_helper, CLONE_VM, *child, *child < 0 ? e : 0, p0);
+    errno = e;
+
+    if (*child < 0) {
+        *step = _("clone failed");
+        munmap(ctx->stack, CLONE_STACK_SIZE);
+        goto fail;
+    }
 
-    time_t monotonic = 0;
-    time_t boottime = 0;
+    return 0;
 
-    uid_t real_euid = geteuid();
-    gid_t real_egid = getegid();
+fail:
+    e = errno;
+    rb_sync_event_close(&ctx->ready);
+    errno = e;
+    return -1;
+}
+
+/*
+ * Resolves the CLONE_NEW* flags requested by args and the implied
+ * options (map_* need a user namespace, mount_proc a mount namespace).
+ */
+int rb_unshare_prepare(struct rb_unshare_args *args, uid_t real_euid, gid_t real_egid)
+{
+    int unshare_flags = 0;
 
-    if (args.clone_newns) {
+    if (args->clone_newns) {
         unshare_flags |= CLONE_NEWNS;
-        // if (optarg)
-        //    set_ns_target(CLONE_NEWNS, optarg);
     }
-    if (args.clone_newuts) {
+    if (args->clone_newuts) {
         unshare_flags |= CLONE_NEWUTS;
-        // if (optarg)
-        //    set_ns_target(CLONE_NEWUTS, optarg);
     }
-    if (args.clone_newipc) {
+    if (args->clone_newipc) {
         unshare_flags |= CLONE_NEWIPC;
-        // if (optarg)
-        //    set_ns_target(CLONE_NEWIPC, optarg);
     }
-    if (args.clone_newnet) {
+    if (args->clone_newnet) {
         unshare_flags |= CLONE_NEWNET;
-        // if (optarg)
-        //    set_ns_target(CLONE_NEWNET, optarg);
     }
-    if (args.clone_newpid) {
+    if (args->clone_newpid) {
         unshare_flags |= CLONE_NEWPID;
-        // if (optarg)
-        //    set_ns_target(CLONE_NEWPID, optarg);
     }
-    if (args.clone_newuser) {
+    if (args->clone_newuser) {
         unshare_flags |= CLONE_NEWUSER;
-        // if (optarg)
-        //    set_ns_target(CLONE_NEWUSER, optarg);
     }
-    if (args.clone_newcgroup) {
+    if (args->clone_newcgroup) {
         unshare_flags |= CLONE_NEWCGROUP;
-        // if (optarg)
-        //    set_ns_target(CLONE_NEWCGROUP, optarg);
     }
-    if (args.clone_newtime) {
+    if (args->clone_newtime) {
         unshare_flags |= CLONE_NEWTIME;
-        // if (optarg)
-        //    set_ns_target(CLONE_NEWTIME, optarg);
     }
-    if (args.mount_proc != Qundef) {
+    if (args->mount_proc) {
         unshare_flags |= CLONE_NEWNS;
-        procmnt = StringValueCStr(args.mount_proc);
     }
-    if (args.map_user != (uid_t) -1) {
+    if (args->uid_map_len || args->gid_map_len) {
         unshare_flags |= CLONE_NEWUSER;
     }
-    if (args.map_group != (gid_t) -1) {
+    if (args->map_user != (uid_t) -1) {
         unshare_flags |= CLONE_NEWUSER;
     }
-    if (args.map_root_user) {
+    if (args->map_group != (gid_t) -1) {
         unshare_flags |= CLONE_NEWUSER;
-        args.map_user = 0;
-        args.map_group = 0;
     }
-    if (args.map_current_user) {
+    if (args->map_root_user) {
         unshare_flags |= CLONE_NEWUSER;
-        args.map_user = real_euid;
-        args.map_group = real_egid;
-    }
-    if (args.kill_child) {
-        args.fork = true;
-        //     if (optarg) {
-        //         if ((kill_child_signo = signame_to_signum(optarg)) < 0)
-        //             errx(EXIT_FAILURE, _("unknown signal: %s"),
-        //                  optarg);
-        //     } else {
-        //         kill_child_signo = SIGKILL;
-        //     }
-    }
-    if (args.keep_caps) {
-        cap_last_cap(); /* Force last cap to be cached before we fork. */
+        args->map_user = 0;
+        args->map_group = 0;
+    }
+    if (args->map_current_user) {
+        unshare_flags |= CLONE_NEWUSER;
+        args->map_user = real_euid;
+        args->map_group = real_egid;
     }
-    if (args.root != Qundef) {
-        newroot = StringValueCStr(args.root);
+    if (args->kill_child) {
+        args->fork = true;
+    }
+    if (args->keep_caps) {
+        cap_last_cap(); /* Force last cap to be cached before we fork. */
     }
-    // case OPT_MONOTONIC:
-    //     monotonic = strtoul_or_err(optarg, _("failed to parse monotonic offset"));
-    //     force_monotonic = 1;
-    //     break;
-    // case OPT_BOOTTIME:
-    //     boottime = strtoul_or_err(optarg, _("failed to parse boottime offset"));
-    //     force_boottime = 1;
-    //     break;
-
-    if ((args.force_monotonic || args.force_boottime) && !(unshare_flags & CLONE_NEWTIME))
-        errx(EXIT_FAILURE, _("options --monotonic and --boottime require "
-                             "unsharing of a time namespace (-t)"));
 
-    if (npersists && (unshare_flags & CLONE_NEWNS))
-        bind_ns_files_from_child(&pid_bind, fds);
+    /* force_* without a time namespace and setgroups=allow with
+     * map_group are rejected by the option parser */
 
-    if (-1 == unshare(unshare_flags))
-        err(EXIT_FAILURE, _("unshare failed"));
+    return unshare_flags;
+}
 
-    if (args.force_boottime)
-        settime(boottime, CLOCK_BOOTTIME);
+/* the namespaces args creates, as the created counters of RUnshare.metrics key them */
+unsigned int rb_unshare_ns_set(const struct rb_unshare_args *args)
+{
+    struct rb_unshare_args copy = *args;
 
-    if (args.force_monotonic)
-        settime(monotonic, CLOCK_MONOTONIC);
+    return ns_set(rb_unshare_prepare(&copy, geteuid(), getegid()));
+}
 
-    if (args.fork) {
-        /* force child forking before mountspace binding
-         * so pid_for_children is populated.
-         * Silence:
-         *      warning: pthread_create failed for timer: Invalid argument, scheduling broken
-         * by setting $VERBOSE = nil.
-         * */
-        VALUE res = rb_eval_string("Process.fork");
-        pid = NIL_P(res) ? 0 : NUM2INT(res);
+/*
+ * Finishes the setup of the namespaces from inside the new process:
+ * id maps, propagation, root, /proc and credentials. On failure returns
+ * -1 with errno set and *step describing what failed.
+ */
+static int unshare_setup_child(const struct rb_unshare_args *args, int unshare_flags,
+                               uid_t real_euid, gid_t real_egid,
+                               struct rb_unshare_timings *t, const char **step)
+{
+    const char *newdir = args->new_dir;
+    uint64_t t0;
 
-        switch(pid) {
-            case -1:
-                err(EXIT_FAILURE, _("fork failed"));
-            case 0:	/* child */
-                if (pid_bind && (unshare_flags & CLONE_NEWNS))
-                    close(fds[1]);
-                break;
-            default: /* parent */
-                break;
+    if (args->kill_child) {
+        if (prctl(PR_SET_PDEATHSIG, SIGKILL) < 0) {
+            *step = _("prctl failed");
+            return -1;
         }
     }
 
-    if (npersists && (pid || !args.fork)) {
-        /* run in parent */
-        if (pid_bind && (unshare_flags & CLONE_NEWNS)) {
-            int rc;
-            char ch = PIPE_SYNC_BYTE;
-
-            /* signal child we are ready */
-            write_all(fds[1], &ch, 1);
-            close(fds[1]);
-            fds[1] = -1;
-
-            /* wait for bind_ns_files_from_child() */
-            do {
-                rc = NUM2INT(PIDT2NUM(rb_waitpid(pid_bind, &status, 0)));
-                if (rc < 0) {
-                    if (errno == EINTR)
-                        continue;
-                    rb_sys_fail("rb_waitpid");
-                }
-                if (WIFEXITED(status) &&
-                    WEXITSTATUS(status) != EXIT_SUCCESS) {
-                    return NUM2PIDT(INT2NUM(pid));
-                }
-            } while (rc < 0);
-        } else {
-            /* simple way, just bind */
-            bind_ns_files(getpid());
+    t0 = timing_now(t);
+    if (args->map_user != (uid_t) -1) {
+        if (map_id(_PATH_PROC_UIDMAP, args->map_user, real_euid) < 0) {
+            *step = _("cannot write " _PATH_PROC_UIDMAP);
+            return -1;
         }
+        timing_add(t, UNSHARE_PHASE_MAP_ID, t0);
     }
 
-    if (pid) {
-        if (!args.wait) {
-            return NUM2PIDT(INT2NUM(pid));
+    /* Since Linux 3.19 unprivileged writing of /proc/self/gid_map
+     * has been disabled unless /proc/self/setgroups is written
+     * first to permanently disable the ability to call setgroups
+     * in that user namespace. */
+    if (args->map_group != (gid_t) -1) {
+        t0 = timing_now(t);
+        if (setgroups_control(SETGROUPS_DENY) < 0) {
+            *step = _("cannot write " _PATH_PROC_SETGROUPS);
+            return -1;
         }
+        timing_add(t, UNSHARE_PHASE_SETGROUPS, t0);
 
-        if (NUM2INT(PIDT2NUM(rb_waitpid(pid, &status, 0))) == -1) {
-            rb_sys_fail("rb_waitpid");
+        t0 = timing_now(t);
+        if (map_id(_PATH_PROC_GIDMAP, args->map_group, real_egid) < 0) {
+            *step = _("cannot write " _PATH_PROC_GIDMAP);
+            return -1;
         }
+        timing_add(t, UNSHARE_PHASE_MAP_ID, t0);
+    }
 
-        if (WIFEXITED(status)) {
-            return NUM2PIDT(INT2NUM(pid));
+    if (args->set_groups != SETGROUPS_NONE) {
+        t0 = timing_now(t);
+        if (setgroups_control(args->set_groups) < 0) {
+            *step = _("cannot write " _PATH_PROC_SETGROUPS);
+            return -1;
         }
+        timing_add(t, UNSHARE_PHASE_SETGROUPS, t0);
+    }
 
-        if (WIFSIGNALED(status)) {
-            kill(getpid(), WTERMSIG(status));
+    if ((unshare_flags & CLONE_NEWNS) && args->propagation) {
+        t0 = timing_now(t);
+        if (set_propagation(args->propagation) != 0) {
+            *step = _("cannot change root filesystem propagation");
+            return -1;
         }
-
-        err(EXIT_FAILURE, _("child exit failed"));
+        timing_add(t, UNSHARE_PHASE_PROPAGATION, t0);
     }
 
-    if (args.kill_child) {
-        // if (kill_child_signo != 0 && prctl(PR_SET_PDEATHSIG, kill_child_signo) < 0)
-        if (prctl(PR_SET_PDEATHSIG, SIGKILL) < 0)
-            err(EXIT_FAILURE, "prctl failed");
+    t0 = timing_now(t);
+    if (args->root) {
+        if (chroot(args->root) != 0) {
+            *step = _("cannot change root directory");
+            return -1;
+        }
+        newdir = newdir ?: "/";
     }
-
-    if (args.map_user != (uid_t) -1)
-        map_id(_PATH_PROC_UIDMAP, args.map_user, real_euid);
-
-    /* Since Linux 3.19 unprivileged writing of /proc/self/gid_map
-     * has been disabled unless /proc/self/setgroups is written
-     * first to permanently disable the ability to call setgroups
-     * in that user namespace. */
-    if (args.map_group != (gid_t) -1) {
-        if (args.set_groups == SETGROUPS_ALLOW)
-            errx(EXIT_FAILURE, _("options --setgroups=allow and "
-                                 "--map-group are mutually exclusive"));
-        setgroups_control(SETGROUPS_DENY);
-        map_id(_PATH_PROC_GIDMAP, args.map_group, real_egid);
+    if (newdir) {
+        if (chdir(newdir)) {
+            *step = _("cannot chdir");
+            return -1;
+        }
+        timing_add(t, UNSHARE_PHASE_CHROOT, t0);
     }
 
-    if (args.set_groups != SETGROUPS_NONE)
-        setgroups_control(args.set_groups);
+    if (args->mount_proc) {
+        uint64_t p0;
+        int rc;
 
-    if ((unshare_flags & CLONE_NEWNS) && args.propagation)
-        set_propagation(args.propagation);
+        t0 = timing_now(t);
 
-    if (newroot) {
-        if (chroot(newroot) != 0)
-            err(EXIT_FAILURE,
-                _("cannot change root directory to '%s'"), newroot);
-        newdir = newdir ?: "/";
-    }
-    if (newdir && chdir(newdir))
-        err(EXIT_FAILURE, _("cannot chdir to '%s'"), newdir);
-
-    if (procmnt) {
         /* When not changing root and using the default propagation flags
            then the recursive propagation change of root will
            automatically change that of an existing proc mount. */
-        if (!newroot && args.propagation != (MS_PRIVATE|MS_REC)) {
-            int rc = mount("none", procmnt, NULL, MS_PRIVATE|MS_REC, NULL);
+        if (!args->root && args->propagation != (MS_PRIVATE|MS_REC)) {
+            p0 = probe_now(mount_propagation);
+            rc = mount("none", args->mount_proc, NULL, MS_PRIVATE|MS_REC, NULL);
+            RUNSHARE_PROBE(mount_propagation, MS_PRIVATE|MS_REC, 0, rc ? errno : 0, p0);
 
             /* Custom procmnt means that proc is very likely not mounted, causing EINVAL.
                Ignoring the error in this specific instance is considered safe. */
-            if(rc != 0 && errno != EINVAL)
-                err(EXIT_FAILURE, _("cannot change %s filesystem propagation"), procmnt);
+            if (rc != 0 && errno != EINVAL) {
+                *step = _("cannot change proc filesystem propagation");
+                return -1;
+            }
         }
 
-        if (mount("proc", procmnt, "proc", MS_NOSUID|MS_NOEXEC|MS_NODEV, NULL) != 0)
-            err(EXIT_FAILURE, _("mount %s failed"), procmnt);
+        p0 = probe_now(mount_proc);
+        rc = mount("proc", args->mount_proc, "proc", MS_NOSUID|MS_NOEXEC|MS_NODEV, NULL);
+        RUNSHARE_PROBE(mount_proc, MS_NOSUID|MS_NOEXEC|MS_NODEV, 0, rc ? errno : 0, p0);
+        if (rc != 0) {
+            *step = _("mount proc failed");
+            return -1;
+        }
+        timing_add(t, UNSHARE_PHASE_MOUNT_PROC, t0);
     }
 
-    if (args.set_gid) {
-        if (setgroups(0, NULL) != 0)	/* drop supplementary groups */
-            err(EXIT_FAILURE, _("setgroups failed"));
-        if (setgid(args.set_gid) < 0)		/* change GID */
-            err(EXIT_FAILURE, _("setgid failed"));
+    t0 = timing_now(t);
+    if (args->set_gid) {
+        if (setgroups(0, NULL) != 0) {	/* drop supplementary groups */
+            *step = _("setgroups failed");
+            return -1;
+        }
+        if (setgid(args->set_gid) < 0) {	/* change GID */
+            *step = _("setgid failed");
+            return -1;
+        }
     }
-    if (args.set_uid && setuid(args.set_uid) < 0)	/* change UID */
-        err(EXIT_FAILURE, _("setuid failed"));
+    if (args->set_uid && setuid(args->set_uid) < 0) {	/* change UID */
+        *step = _("setuid failed");
+        return -1;
+    }
+    if (args->set_gid || args->set_uid)
+        timing_add(t, UNSHARE_PHASE_CREDENTIALS, t0);
 
     /* We use capabilities system calls to propagate the permitted
      * capabilities into the ambient set because we have already
      * forked so are in async-signal-safe context. */
-    if (args.keep_caps && (unshare_flags & CLONE_NEWUSER)) {
+    if (args->keep_caps && (unshare_flags & CLONE_NEWUSER)) {
         struct __user_cap_header_struct header = {
             .version = _LINUX_CAPABILITY_VERSION_3,
             .pid = 0,
@@ -469,16 +613,21 @@ int rb_unshare_internal(struct rb_unshare_args args)
         struct __user_cap_data_struct payload[_LINUX_CAPABILITY_U32S_3] = {{ 0 }};
         uint64_t effective, cap;
 
-        if (capget(&header, payload) < 0)
-            err(EXIT_FAILURE, _("capget failed"));
+        t0 = timing_now(t);
+        if (capget(&header, payload) < 0) {
+            *step = _("capget failed");
+            return -1;
+        }
 
         /* In order the make capabilities ambient, we first need to ensure
          * that they are all inheritable. */
         payload[0].inheritable = payload[0].permitted;
         payload[1].inheritable = payload[1].permitted;
 
-        if (capset(&header, payload) < 0)
-            err(EXIT_FAILURE, _("capset failed"));
+        if (capset(&header, payload) < 0) {
+            *step = _("capset failed");
+            return -1;
+        }
 
         effective = ((uint64_t)payload[1].effective << 32) |  (uint64_t)payload[0].effective;
 
@@ -489,10 +638,1369 @@ int rb_unshare_internal(struct rb_unshare_args args)
                 continue;
 
             if ((effective & (1 << cap))
-                && prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_RAISE, cap, 0, 0) < 0)
-                err(EXIT_FAILURE, _("prctl(PR_CAP_AMBIENT) failed"));
+                && prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_RAISE, cap, 0, 0) < 0) {
+                *step = _("prctl(PR_CAP_AMBIENT) failed");
+                return -1;
+            }
+        }
+        timing_add(t, UNSHARE_PHASE_CAPS, t0);
+    }
+
+    return 0;
+}
+
+/*
+ * The parts of rb_unshare_internal() that touch no ruby objects run
+ * without the GVL, so other ruby threads go on meanwhile (creating a
+ * network namespace alone can take tens of milliseconds). None of the
+ * syscalls can be interrupted, so there is no unblocking function; a
+ * pending Thread#raise is delivered once they return.
+ */
+struct unshare_nogvl {
+    struct rb_unshare_args *args;
+    int unshare_flags;
+    time_t monotonic;
+    time_t boottime;
+    uid_t real_euid;
+    gid_t real_egid;
+    struct rb_unshare_timings *t;
+
+    const char *step;
+    int err;
+};
+
+static void *unshare_nogvl(void *data)
+{
+    struct unshare_nogvl *ctx = data;
+    uint64_t t0 = timing_now(ctx->t), p0 = probe_now(unshare);
+    int rc;
+
+    rc = unshare(ctx->unshare_flags);
+    RUNSHARE_PROBE(unshare, ctx->unshare_flags, 0, rc ? errno : 0, p0);
+
+    if (-1 == rc)
+        ctx->step = _("unshare failed");
+    else if (ctx->args->force_boottime && settime(ctx->boottime, CLOCK_BOOTTIME) < 0)
+        ctx->step = _("failed to write to /proc/self/timens_offsets");
+    else if (ctx->args->force_monotonic && settime(ctx->monotonic, CLOCK_MONOTONIC) < 0)
+        ctx->step = _("failed to write to /proc/self/timens_offsets");
+    else {
+        timing_add(ctx->t, UNSHARE_PHASE_UNSHARE, t0);
+        return NULL;
+    }
+
+    ctx->err = errno ?: EINVAL;
+    return NULL;
+}
+
+/* id maps, mounts, chroot and credentials of the new namespaces */
+static void *setup_nogvl(void *data)
+{
+    struct unshare_nogvl *ctx = data;
+    uint64_t p0 = probe_now(setup);
+
+    if (unshare_setup_child(ctx->args, ctx->unshare_flags, ctx->real_euid,
+                            ctx->real_egid, ctx->t, &ctx->step) < 0)
+        ctx->err = errno ?: EINVAL;
+    RUNSHARE_PROBE(setup, ctx->unshare_flags, 0, ctx->err, p0);
+
+    return NULL;
+}
+
+/* what the forked child of rb_unshare_internal() reports about its setup */
+struct setup_report {
+    int err;
+    const char *step;	/* static string, same address after fork */
+    struct rb_unshare_timings timings;	/* of the phases in the child */
+};
+
+/* waits for the setup report of the forked child, see rb_unshare_internal() */
+struct report_nogvl {
+    int fd;
+    struct setup_report report;
+    ssize_t n;
+};
+
+static void *report_nogvl(void *data)
+{
+    struct report_nogvl *ctx = data;
+
+    ctx->n = rb_sync_read(ctx->fd, &ctx->report, sizeof(ctx->report), SYNC_TIMEOUT_MS);
+    return NULL;
+}
+
+static void kill_reap(pid_t pid)
+{
+    int status;
+
+    kill(pid, SIGKILL);
+    while (rb_waitpid(pid, &status, 0) < 0 && errno == EINTR);
+}
+
+/*
+ * Unshares the namespaces of args in the calling process, or with fork
+ * in a child of it. Returns the pid of the child in the parent and 0
+ * otherwise, or -1 with errno set and *step describing what failed.
+ * Nothing here exits the process: a forked child that fails its setup
+ * reports over a pipe and exits, the parent reaps it and fails in turn.
+ * With t the parent gets the timings of its own and the child's phases.
+ */
+static VALUE fork_ruby(VALUE unused)
+{
+    return rb_funcall(rb_mProcess, rb_intern("fork"), 0);
+}
+
+int rb_unshare_internal(struct rb_unshare_args args, struct rb_unshare_timings *t,
+                        const char **step)
+{
+    int unshare_flags = 0;
+
+    struct unshare_nogvl nogvl;
+    struct report_nogvl report = { .fd = -1 };
+
+    int status, e, fork_state = 0;
+    int fds[2] = { -1, -1 };
+
+    struct ns_targets targets = { .count = 0 };
+    struct bind_ctx bind_ctx = { .targets = &targets };
+    int pid_bind = 0;
+    int pid = 0;
+
+    time_t monotonic = 0;
+    time_t boottime = 0;
+
+    uid_t real_euid = geteuid();
+    gid_t real_egid = getegid();
+
+    uint64_t start = timing_now(t), t0, p0;
+    uint64_t m0 = rb_metrics_now();
+
+    unshare_flags = rb_unshare_prepare(&args, real_euid, real_egid);
+
+    if (args.persist && persist_ns_targets(&targets, args.persist, unshare_flags) < 0) {
+        *step = _("cannot create bind targets");
+        return -1;
+    }
+
+    if (targets.count && (unshare_flags & CLONE_NEWNS)) {
+        t0 = timing_now(t);
+        if (bind_ns_files_from_child(&pid_bind, &bind_ctx, step) < 0)
+            return -1;
+        timing_add(t, UNSHARE_PHASE_HELPER, t0);
+    }
+
+    nogvl = (struct unshare_nogvl) {
+        .args = &args,
+        .unshare_flags = unshare_flags,
+        .monotonic = monotonic,
+        .boottime = boottime,
+        .t = t,
+    };
+    rb_thread_call_without_gvl(unshare_nogvl, &nogvl, NULL, NULL);
+    if (nogvl.err) {
+        *step = nogvl.step;
+        errno = nogvl.err;
+        goto fail;
+    }
+
+    if (args.fork) {
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            *step = _("pipe failed");
+            fds[0] = fds[1] = -1;
+            goto fail;
+        }
+
+        /* force child forking before mountspace binding
+         * so pid_for_children is populated.
+         * Silence:
+         *      warning: pthread_create failed for timer: Invalid argument, scheduling broken
+         * by setting $VERBOSE = nil.
+         * */
+        t0 = timing_now(t);
+        p0 = probe_now(fork);
+        /* Process.fork raises, the pipe and the bind helper must not leak */
+        VALUE res = rb_protect(fork_ruby, Qnil, &fork_state);
+        if (fork_state) {
+            VALUE exc = rb_errinfo();
+
+            *step = _("fork failed");
+            errno = EAGAIN;
+            if (rb_obj_is_kind_of(exc, rb_eSystemCallError)) {
+                /* becomes a RUnshare::Error of the caller */
+                errno = NUM2INT(rb_funcall(exc, rb_intern("errno"), 0));
+                rb_set_errinfo(Qnil);
+                fork_state = 0;
+            }
+            RUNSHARE_PROBE(fork, unshare_flags, -1, errno, p0);
+            goto fail;
+        }
+        pid = NIL_P(res) ? 0 : NUM2INT(res);
+        if (pid)
+            RUNSHARE_PROBE(fork, unshare_flags, pid, 0, p0);
+
+        switch(pid) {
+            case 0:	/* child */
+                if (pid_bind && (unshare_flags & CLONE_NEWNS))
+                    rb_sync_event_close(&bind_ctx.ready);
+                close(fds[0]);
+                /* reports its own phases only */
+                if (t)
+                    memset(t, 0, sizeof(*t));
+                break;
+            default: /* parent */
+                timing_add(t, UNSHARE_PHASE_FORK, t0);
+                close(fds[1]);
+                fds[1] = -1;
+                break;
+        }
+    }
+
+    if (targets.count && (pid || !args.fork)) {
+        /* run in parent */
+        t0 = timing_now(t);
+        p0 = probe_now(bind);
+        if (pid_bind && (unshare_flags & CLONE_NEWNS)) {
+            int saved = errno;
+            pid_t rc;
+
+            /* signal child we are ready */
+            rb_sync_event_signal(&bind_ctx.ready);
+
+            /* wait for bind_ns_files_from_child(), errno is the helper's
+             * too until then (see bind_helper()) */
+            do {
+                rc = rb_waitpid(pid_bind, &status, 0);
+            } while (rc < 0 && errno == EINTR);
+            errno = saved;
+
+            /* the helper may still run, the fail path kills and reaps it */
+            if (rc < 0) {
+                *step = _("cannot wait for mount helper");
+                errno = EIO;
+                RUNSHARE_PROBE(bind, unshare_flags, pid, errno, p0);
+                goto fail;
+            }
+            munmap(bind_ctx.stack, CLONE_STACK_SIZE);
+            rb_sync_event_close(&bind_ctx.ready);
+            pid_bind = 0;
+
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                *step = _("mount of namespace files failed");
+                errno = bind_ctx.err ?: EIO;
+                RUNSHARE_PROBE(bind, unshare_flags, pid, errno, p0);
+                goto fail;
+            }
+        } else if (bind_ns_files(&targets, getpid()) != 0) {
+            /* simple way, just bind */
+            *step = _("mount of namespace files failed");
+            RUNSHARE_PROBE(bind, unshare_flags, pid, errno, p0);
+            goto fail;
+        }
+        RUNSHARE_PROBE(bind, unshare_flags, pid, 0, p0);
+        timing_add(t, UNSHARE_PHASE_BIND, t0);
+    }
+
+    if (pid) {
+        /* EOF once the child is through its setup */
+        report.fd = fds[0];
+        rb_thread_call_without_gvl(report_nogvl, &report, NULL, NULL);
+        e = errno;
+        close(fds[0]);
+        fds[0] = -1;
+
+        if (report.n == sizeof(report.report) && report.report.err) {
+            *step = report.report.step;
+            errno = report.report.err;
+            goto fail;
+        } else if (report.n < 0) {
+            *step = _("child setup did not finish");
+            errno = e;
+            goto fail;
+        }
+
+        if (t && report.n == sizeof(report.report)) {
+            int i;
+
+            for (i = 0; i < UNSHARE_PHASE_COUNT; i++)
+                t->ns[i] += report.report.timings.ns[i];
+            t->ran |= report.report.timings.ran;
+        }
+        timing_add(t, UNSHARE_PHASE_TOTAL, start);
+        rb_metrics_created(ns_set(unshare_flags), METRICS_PATH_FORK, m0);
+
+        /* the caller waits for the child if asked to, see RUnshare::Child */
+        return NUM2PIDT(INT2NUM(pid));
+    }
+
+    nogvl.real_euid = real_euid;
+    nogvl.real_egid = real_egid;
+    rb_thread_call_without_gvl(setup_nogvl, &nogvl, NULL, NULL);
+
+    if (args.fork) {
+        /* the ruby code of the child never runs after a failed setup,
+         * a successful one reports only with timings */
+        if (nogvl.err || t) {
+            struct setup_report r = { .err = nogvl.err, .step = nogvl.step };
+
+            if (t)
+                r.timings = *t;
+            rb_sync_write(fds[1], &r, sizeof(r), SYNC_TIMEOUT_MS);
+            if (nogvl.err)
+                _exit(EXIT_FAILURE);
         }
+        close(fds[1]);
+    } else if (nogvl.err) {
+        *step = nogvl.step;
+        errno = nogvl.err;
+        return -1;
     }
 
+    if (!args.fork)
+        timing_add(t, UNSHARE_PHASE_TOTAL, start);
+
     return NUM2PIDT(INT2NUM(pid));
+
+fail:
+    e = errno;
+    if (pid_bind) {
+        kill_reap(pid_bind);
+        munmap(bind_ctx.stack, CLONE_STACK_SIZE);
+        rb_sync_event_close(&bind_ctx.ready);
+    }
+    if (pid > 0)
+        kill_reap(pid);
+    if (fds[0] >= 0)
+        close(fds[0]);
+    if (fds[1] >= 0)
+        close(fds[1]);
+    /* anything but a system call error, e.g. an interrupt, goes on up */
+    if (fork_state)
+        rb_jump_tag(fork_state);
+    errno = e;
+    return -1;
+}
+
+/*
+ * Shared with the id map helper of rb_unshare_spawn_internal(). A new
+ * user namespace can only get more than its owner's id mapped from
+ * outside, by a process with CAP_SETUID over the parent namespace or
+ * by the setuid newuidmap(1), so the spawned child waits for it.
+ */
+struct idmap_ctx {
+    const struct rb_unshare_args *args;
+    pid_t pid;			/* of the child, set by CLONE_PARENT_SETTID */
+    struct rb_sync_event ready;	/* the child waits for its maps */
+    struct rb_sync_event done;	/* the maps are written */
+    void *stack;
+
+    /* written by the helper before it signals done */
+    const char *step;
+    int err;
+};
+
+/* shared between the caller and the CLONE_VM child of rb_unshare_spawn_internal() */
+struct spawn_ctx {
+    const struct rb_unshare_args *args;
+    struct idmap_ctx *idmap;
+    int unshare_flags;
+    uid_t real_euid;
+    gid_t real_egid;
+    char *const *argv;
+    char *const *envp;
+    const sigset_t *oldmask;
+
+    /* shared memory, the child adds its phases */
+    struct rb_unshare_timings *t;
+    uint64_t t0;	/* start of the running phase, clone or exec */
+
+    /* written by the child before it exits, read once clone() returns */
+    const char *step;
+    int err;
+};
+
+/*
+ * Runs on its own stack in the caller's address space while the caller
+ * is suspended (CLONE_VFORK), so it must stay async-signal-safe: no ruby,
+ * no malloc, no stdio. Only execve() or _exit() leave this function.
+ */
+static void reset_signal_handlers(void)
+{
+    struct sigaction sa;
+    int sig;
+
+    for (sig = 1; sig < NSIG; sig++) {
+        if (sigaction(sig, NULL, &sa) == 0 &&
+            sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL) {
+            sa.sa_handler = SIG_DFL;
+            sigaction(sig, &sa, NULL);
+        }
+    }
+}
+
+static int spawn_child(void *data)
+{
+    struct spawn_ctx *ctx = data;
+    uint64_t t0, p0;
+
+    timing_add(ctx->t, UNSHARE_PHASE_CLONE, ctx->t0);
+
+    /* the handler table was copied (no CLONE_SIGHAND), so ruby's handlers
+     * can be reset here without touching the parent's ones */
+    reset_signal_handlers();
+
+    /* nothing below works as the mapped ids before the maps are written */
+    if (ctx->idmap) {
+        t0 = timing_now(ctx->t);
+        if (rb_sync_event_signal(&ctx->idmap->ready) < 0 ||
+            rb_sync_event_wait(&ctx->idmap->done, SYNC_TIMEOUT_MS) < 0) {
+            ctx->step = _("id map helper failed");
+            goto fail;
+        }
+        if (ctx->idmap->err) {
+            errno = ctx->idmap->err;
+            ctx->step = ctx->idmap->step;
+            goto fail;
+        }
+        timing_add(ctx->t, UNSHARE_PHASE_IDMAP, t0);
+    }
+
+    /* CLONE_NEWTIME shares bits with the exit signal in clone(2), so the
+     * time namespace is unshared here; execve() switches into it. */
+    if (ctx->unshare_flags & CLONE_NEWTIME) {
+        t0 = timing_now(ctx->t);
+        if (unshare(CLONE_NEWTIME) < 0) {
+            ctx->step = _("unshare failed");
+            goto fail;
+        }
+        if ((ctx->args->force_boottime && settime(0, CLOCK_BOOTTIME) < 0) ||
+            (ctx->args->force_monotonic && settime(0, CLOCK_MONOTONIC) < 0)) {
+            ctx->step = _("failed to write to /proc/self/timens_offsets");
+            goto fail;
+        }
+        timing_add(ctx->t, UNSHARE_PHASE_UNSHARE, t0);
+    }
+
+    if (ctx->args->nsset) {
+        int i;
+
+        t0 = timing_now(ctx->t);
+        /* the table lists the user namespace first, which has to be
+         * entered before the ones it owns */
+        for (i = 0; i < UNSHARE_NS_COUNT; i++) {
+            if (ctx->args->nsset->fds[i] >= 0 &&
+                setns(ctx->args->nsset->fds[i], namespace_files[i].type) != 0) {
+                ctx->step = _("setns failed");
+                goto fail;
+            }
+        }
+        timing_add(ctx->t, UNSHARE_PHASE_SETNS, t0);
+    }
+
+    p0 = probe_now(setup);
+    if (unshare_setup_child(ctx->args, ctx->unshare_flags,
+                            ctx->real_euid, ctx->real_egid, ctx->t, &ctx->step) < 0) {
+        RUNSHARE_PROBE(setup, ctx->unshare_flags, 0, errno, p0);
+        goto fail;
+    }
+    RUNSHARE_PROBE(setup, ctx->unshare_flags, 0, 0, p0);
+
+    sigprocmask(SIG_SETMASK, ctx->oldmask, NULL);
+
+    /* the caller ends the exec phase once the vfork is released */
+    ctx->t0 = timing_now(ctx->t);
+    execvpe(ctx->argv[0], ctx->argv, ctx->envp);
+    ctx->step = _("failed to execute");
+
+fail:
+    ctx->err = errno ?: EINVAL;
+    _exit(errno == ENOENT ? EX_EXEC_ENOENT : EX_EXEC_FAILED);
+}
+
+/*
+ * Runs fn on a private stack in our address space (CLONE_VM) and sleeps
+ * until it has called execve() or exited (CLONE_VFORK), so it costs the
+ * same regardless of the size of the ruby heap. All signals are blocked
+ * meanwhile, *oldmask gets the mask fn has to restore before execve().
+ * With ptid set the kernel stores the pid there before fn starts.
+ * Returns the pid of the child, which has to be reaped by the caller.
+ */
+static pid_t clone_vfork(int (*fn)(void *), void *arg, int flags, sigset_t *oldmask,
+                         pid_t *ptid)
+{
+    sigset_t all;
+    void *stack;
+    pid_t pid;
+    int e;
+
+    stack = mmap(NULL, CLONE_STACK_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED)
+        return -1;
+
+    /* no ruby signal handler may run on the child's stack */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, oldmask);
+
+    if (ptid)
+        flags |= CLONE_PARENT_SETTID;
+    pid = clone(fn, (char *) stack + CLONE_STACK_SIZE,
+                CLONE_VM | CLONE_VFORK | SIGCHLD | flags, arg, ptid);
+    e = errno;
+
+    pthread_sigmask(SIG_SETMASK, oldmask, NULL);
+    munmap(stack, CLONE_STACK_SIZE);
+
+    errno = e;
+    return pid;
+}
+
+static void reap(pid_t pid)
+{
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+}
+
+/* "inner outer count" lines of map, the format of /proc/<pid>/uid_map */
+static int format_idmap(char *buf, size_t size, const struct rb_unshare_idmap *map, int len)
+{
+    int i, off = 0;
+
+    for (i = 0; i < len; i++)
+        off += snprintf(buf + off, size - off, "%u %u %u\n",
+                        map[i].inner, map[i].outer, map[i].count);
+
+    return off;
+}
+
+/* runs newuidmap(1) or newgidmap(1), which check /etc/subuid or /etc/subgid */
+static int run_newidmap(const char *prog, pid_t pid, const struct rb_unshare_idmap *map,
+                        int len)
+{
+    char strs[1 + 3 * UNSHARE_IDMAP_MAX][sizeof(stringify_value(UINT32_MAX))];
+    char *argv[2 + 3 * UNSHARE_IDMAP_MAX + 1];
+    int i, n = 0, status;
+    sigset_t none;
+    pid_t child;
+
+    argv[n++] = (char *) prog;
+    snprintf(strs[0], sizeof(strs[0]), "%d", pid);
+    argv[n++] = strs[0];
+    for (i = 0; i < len; i++) {
+        snprintf(strs[1 + 3 * i], sizeof(strs[0]), "%u", map[i].inner);
+        snprintf(strs[2 + 3 * i], sizeof(strs[0]), "%u", map[i].outer);
+        snprintf(strs[3 + 3 * i], sizeof(strs[0]), "%u", map[i].count);
+        argv[n++] = strs[1 + 3 * i];
+        argv[n++] = strs[2 + 3 * i];
+        argv[n++] = strs[3 + 3 * i];
+    }
+    argv[n] = NULL;
+
+    child = vfork();
+    if (child < 0)
+        return -1;
+    if (child == 0) {
+        reset_signal_handlers();
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execvp(prog, argv);
+        _exit(errno == ENOENT ? EX_EXEC_ENOENT : EX_EXEC_FAILED);
+    }
+
+    while (waitpid(child, &status, 0) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        errno = WIFEXITED(status) && WEXITSTATUS(status) == EX_EXEC_ENOENT ? ENOENT : EPERM;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes all lines of the map at once, the kernel takes a single write
+ * only. Without CAP_SETUID over the parent namespace the setuid helper
+ * prog writes the ranges it allows instead.
+ */
+static int write_idmap(pid_t pid, const char *file, const char *prog,
+                       const struct rb_unshare_idmap *map, int len)
+{
+    char path[sizeof("/proc//gid_map") + sizeof(stringify_value(INT32_MAX))];
+    char buf[UNSHARE_IDMAP_MAX * 3 * sizeof(stringify_value(UINT32_MAX))];
+    int fd, n, rc = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, file);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    n = format_idmap(buf, sizeof(buf), map, len);
+    if (write(fd, buf, n) != n)
+        rc = -1;
+    close(fd);
+
+    if (rc < 0 && errno == EPERM)
+        return run_newidmap(prog, pid, map, len);
+
+    return rc;
+}
+
+/* in the parent user namespace, all signals blocked, see struct idmap_ctx */
+static int idmap_helper(void *data)
+{
+    struct idmap_ctx *ctx = data;
+    const struct rb_unshare_args *args = ctx->args;
+
+    if (rb_sync_event_wait(&ctx->ready, SYNC_TIMEOUT_MS) != 0)
+        _exit(EXIT_FAILURE);
+
+    if (args->uid_map_len &&
+        write_idmap(ctx->pid, "uid_map", "newuidmap", args->uid_map, args->uid_map_len) < 0) {
+        ctx->step = _("cannot write uid_map");
+        ctx->err = errno;
+    } else if (args->gid_map_len &&
+               write_idmap(ctx->pid, "gid_map", "newgidmap", args->gid_map, args->gid_map_len) < 0) {
+        ctx->step = _("cannot write gid_map");
+        ctx->err = errno;
+    }
+
+    rb_sync_event_signal(&ctx->done);
+    _exit(ctx->err ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/* starts idmap_helper() like bind_ns_files_from_child(), returns its pid */
+static pid_t idmap_start(struct idmap_ctx *ctx)
+{
+    sigset_t all, old;
+    pid_t pid;
+    int e;
+
+    ctx->ready.fd = ctx->done.fd = -1;
+    ctx->stack = MAP_FAILED;
+    if (rb_sync_event_open(&ctx->ready) < 0 || rb_sync_event_open(&ctx->done) < 0)
+        goto fail;
+
+    ctx->stack = mmap(NULL, CLONE_STACK_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (ctx->stack == MAP_FAILED)
+        goto fail;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pid = clone(idmap_helper, (char *) ctx->stack + CLONE_STACK_SIZE,
+                CLONE_VM | SIGCHLD, ctx);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (pid > 0)
+        return pid;
+
+fail:
+    e = errno;
+    if (ctx->stack != MAP_FAILED)
+        munmap(ctx->stack, CLONE_STACK_SIZE);
+    rb_sync_event_close(&ctx->ready);
+    rb_sync_event_close(&ctx->done);
+    errno = e;
+    return -1;
+}
+
+/* the helper may still wait for a child that never asked for its maps */
+static void idmap_finish(struct idmap_ctx *ctx, pid_t helper)
+{
+    kill(helper, SIGKILL);
+    reap(helper);
+    munmap(ctx->stack, CLONE_STACK_SIZE);
+    rb_sync_event_close(&ctx->ready);
+    rb_sync_event_close(&ctx->done);
+}
+
+/*
+ * Starts argv in new namespaces without forking the ruby heap, see
+ * clone_vfork(). Returns the pid, or -1 with errno set and *step
+ * describing the failure. With t the phases of the caller and the child
+ * are timed.
+ */
+pid_t rb_unshare_spawn_internal(struct rb_unshare_args args, char *const argv[],
+                                char *const envp[], struct rb_unshare_timings *t,
+                                const char **step)
+{
+    struct spawn_ctx ctx = {
+        .args = &args,
+        .real_euid = geteuid(),
+        .real_egid = getegid(),
+        .argv = argv,
+        .envp = envp,
+        .t = t,
+    };
+    struct idmap_ctx idmap = { .args = &args };
+    pid_t pid, helper = 0;
+    sigset_t old;
+    uint64_t start = timing_now(t), p0;
+    uint64_t m0 = rb_metrics_now();
+
+    ctx.unshare_flags = rb_unshare_prepare(&args, ctx.real_euid, ctx.real_egid);
+    ctx.oldmask = &old;
+
+    if (args.uid_map_len || args.gid_map_len) {
+        ctx.t0 = timing_now(t);
+        helper = idmap_start(&idmap);
+        if (helper < 0) {
+            *step = _("cannot start id map helper");
+            return -1;
+        }
+        ctx.idmap = &idmap;
+        timing_add(t, UNSHARE_PHASE_HELPER, ctx.t0);
+    }
+
+    ctx.t0 = timing_now(t);
+    p0 = probe_now(clone);
+    pid = clone_vfork(spawn_child, &ctx, ctx.unshare_flags & ~CLONE_NEWTIME, &old,
+                      helper ? &idmap.pid : NULL);
+    RUNSHARE_PROBE(clone, ctx.unshare_flags, pid, pid < 0 ? errno : ctx.err, p0);
+    if (pid < 0) {
+        ctx.step = _("clone failed");
+        ctx.err = errno;
+    } else {
+        timing_add(t, UNSHARE_PHASE_EXEC, ctx.t0);
+    }
+
+    if (helper)
+        idmap_finish(&idmap, helper);
+
+    if (ctx.err) {
+        /* the child is gone already, collect it so it does not linger */
+        if (pid > 0)
+            reap(pid);
+        *step = ctx.step;
+        errno = ctx.err;
+        return -1;
+    }
+    timing_add(t, UNSHARE_PHASE_TOTAL, start);
+    /* a recycled network namespace is new to the sandbox all the same */
+    rb_metrics_created(ns_set(ctx.unshare_flags | (args.netns_recycled ? CLONE_NEWNET : 0)),
+                       METRICS_PATH_SPAWN, m0);
+
+    return pid;
+}
+
+const char *rb_unshare_ns_name(int idx)
+{
+    /* without the ns/ prefix */
+    return namespace_files[idx].name + 3;
+}
+
+int rb_unshare_ns_type(int idx)
+{
+    return namespace_files[idx].type;
+}
+
+/*
+ * Like rb_unshare_setns_internal() for the namespaces pinned in set.
+ * Selected namespaces missing from the set are ignored.
+ */
+int rb_unshare_nsset_enter(const struct rb_unshare_nsset *set, unsigned int mask,
+                           const char **step)
+{
+    char self[PATH_MAX];
+    struct stat a, b;
+    int flags = 0, i;
+
+    for (i = 0; namespace_files[i].name; i++) {
+        if ((mask & (1U << i)) && set->fds[i] >= 0)
+            flags |= namespace_files[i].type;
+    }
+
+    if ((flags & CLONE_NEWNS) && unshare(CLONE_FS) != 0) {
+        *step = _("unshare(CLONE_FS) failed");
+        return -1;
+    }
+
+    for (i = 0; namespace_files[i].name; i++) {
+        if (!(mask & (1U << i)) || set->fds[i] < 0)
+            continue;
+
+        /* setns() into our own user namespace fails */
+        snprintf(self, sizeof(self), "/proc/self/%s", namespace_files[i].name);
+        if (namespace_files[i].type == CLONE_NEWUSER &&
+            fstat(set->fds[i], &a) == 0 && stat(self, &b) == 0 &&
+            a.st_ino == b.st_ino && a.st_dev == b.st_dev)
+            continue;
+
+        if (setns(set->fds[i], namespace_files[i].type) != 0) {
+            *step = _("setns failed");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* the pid the pidfd refers to, from its fdinfo */
+static pid_t pidfd_getpid(int pidfd)
+{
+    char path[PATH_MAX], buf[BUFSIZ], *p;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", pidfd);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    n = rb_sync_read(fd, buf, sizeof(buf) - 1, -1);
+    close(fd);
+    if (n < 0)
+        return -1;
+    buf[n] = '\0';
+
+    p = strstr(buf, "\nPid:");
+    if (!p) {
+        errno = EBADF;
+        return -1;
+    }
+    return strtol(p + 5, NULL, 10);
+}
+
+/* whether the namespace file path is the one we are in already */
+static int ns_is_current(const char *path, const char *self)
+{
+    struct stat a, b;
+
+    return stat(path, &a) == 0 && stat(self, &b) == 0 &&
+           a.st_ino == b.st_ino && a.st_dev == b.st_dev;
+}
+
+/*
+ * Moves the calling thread into the namespaces of pid, or of pidfd if
+ * it is not negative, selected by mask (a bit per namespace_files
+ * entry). Since Linux 5.8 that is a single setns() on the pidfd, on
+ * older kernels (see rb_features) the /proc/<pid>/ns files are entered
+ * one by one, user first. Joining a mount namespace detaches
+ * the root and cwd of the thread from the other threads first. Returns
+ * 0, or -1 with errno and *step.
+ */
+int rb_unshare_setns_internal(pid_t pid, int pidfd, unsigned int mask, const char **step)
+{
+    char path[PATH_MAX], self[PATH_MAX];
+    int flags = 0, own = -1, fd, rc, i;
+
+    for (i = 0; namespace_files[i].name; i++) {
+        if (mask & (1U << i))
+            flags |= namespace_files[i].type;
+    }
+
+    /* setns(CLONE_NEWNS) refuses a shared fs_struct, ruby has threads */
+    if ((flags & CLONE_NEWNS) && unshare(CLONE_FS) != 0) {
+        *step = _("unshare(CLONE_FS) failed");
+        return -1;
+    }
+
+    if (rb_features.setns_pidfd) {
+        if (pidfd < 0) {
+            pidfd = own = pidfd_open(pid, 0);
+            if (pidfd < 0) {
+                *step = _("pidfd_open failed");
+                return -1;
+            }
+        }
+        rc = setns(pidfd, flags);
+        if (own >= 0)
+            close(own);
+        if (rc != 0)
+            *step = _("setns failed");
+        return rc;
+    }
+
+    /* pid may have been reused since, it is only a fallback */
+    if (pid <= 0 && (pid = pidfd_getpid(pidfd)) <= 0) {
+        *step = _("cannot get pid of pidfd");
+        return -1;
+    }
+
+    for (i = 0; namespace_files[i].name; i++) {
+        const char *name = namespace_files[i].name;
+        int type = namespace_files[i].type;
+
+        if (!(mask & (1U << i)))
+            continue;
+
+        /* join the namespaces the process is in, not of its children */
+        if (type == CLONE_NEWPID)
+            name = "ns/pid";
+        else if (type == CLONE_NEWTIME)
+            name = "ns/time";
+
+        snprintf(path, sizeof(path), "/proc/%d/%s", (int) pid, name);
+        snprintf(self, sizeof(self), "/proc/self/%s", name);
+
+        /* setns() into our own user namespace fails */
+        if (type == CLONE_NEWUSER && ns_is_current(path, self))
+            continue;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            *step = _("cannot open namespace");
+            return -1;
+        }
+        rc = setns(fd, type);
+        close(fd);
+        if (rc != 0) {
+            *step = _("setns failed");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* shared between the caller and the CLONE_VM child of the nsset functions */
+struct nsset_ctx {
+    struct rb_unshare_nsset *set;
+    int flags;
+    const char *scratch;
+    char *baseline;		/* NETNS_BASELINE_MAX bytes for rb_netns_snapshot() */
+
+    /* written by the child before it exits */
+    const char *step;
+    int err;
+    ssize_t baseline_len;
+};
+
+static int mount_scratch(const char *scratch)
+{
+    return mount("tmpfs", scratch, "tmpfs", MS_NOSUID | MS_NODEV, "mode=1777");
+}
+
+/*
+ * Runs in the new namespaces. Sharing our fd table (CLONE_FILES), it
+ * opens the nsfs files right into the caller, which keeps them alive
+ * after we are gone.
+ */
+static int nsset_create_child(void *data)
+{
+    struct nsset_ctx *ctx = data;
+    char path[PATH_MAX];
+    int i;
+
+    if (ctx->scratch) {
+        if (set_propagation(MS_REC | MS_PRIVATE) != 0) {
+            ctx->step = _("cannot change root filesystem propagation");
+            goto fail;
+        }
+        if (mount_scratch(ctx->scratch) != 0) {
+            ctx->step = _("cannot mount scratch");
+            goto fail;
+        }
+    }
+
+    for (i = 0; i < UNSHARE_NS_COUNT; i++) {
+        if (!(namespace_files[i].type & ctx->flags))
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/self/%s", namespace_files[i].name);
+        ctx->set->fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+        if (ctx->set->fds[i] < 0) {
+            ctx->step = _("cannot open namespace file");
+            goto fail;
+        }
+    }
+
+    if (ctx->baseline)
+        ctx->baseline_len = rb_netns_snapshot(ctx->baseline, NETNS_BASELINE_MAX);
+
+    _exit(EXIT_SUCCESS);
+
+fail:
+    ctx->err = errno ?: EINVAL;
+    _exit(EXIT_FAILURE);
+}
+
+void rb_unshare_nsset_close(struct rb_unshare_nsset *set)
+{
+    int i;
+
+    for (i = 0; i < UNSHARE_NS_COUNT; i++) {
+        if (set->fds[i] >= 0)
+            close(set->fds[i]);
+        set->fds[i] = -1;
+    }
+}
+
+/*
+ * Creates the namespaces of flags and pins them by nsfs fds in set. A
+ * tmpfs is mounted on scratch in the new mount namespace if given. The
+ * pid and time namespaces can not live without a process and are not
+ * supported. Returns 0, or -1 with errno set and *step.
+ */
+int rb_unshare_nsset_create(struct rb_unshare_nsset *set, int flags,
+                            const char *scratch, const char **step)
+{
+    struct nsset_ctx ctx = { .set = set, .flags = flags, .scratch = scratch };
+    sigset_t old;
+    pid_t pid;
+    int i;
+
+    for (i = 0; i < UNSHARE_NS_COUNT; i++)
+        set->fds[i] = -1;
+
+    if ((flags & (CLONE_NEWPID | CLONE_NEWTIME)) ||
+        (scratch && !(flags & CLONE_NEWNS))) {
+        *step = _("unsupported namespace set");
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* the first new network namespace shows what a flush brings back */
+    if ((flags & CLONE_NEWNET) && rb_netns_need_baseline()) {
+        ctx.baseline = malloc(NETNS_BASELINE_MAX);
+        ctx.baseline_len = -1;
+    }
+
+    pid = clone_vfork(nsset_create_child, &ctx, CLONE_FILES | flags, &old, NULL);
+    if (pid < 0) {
+        ctx.step = _("clone failed");
+        ctx.err = errno;
+    } else {
+        reap(pid);
+    }
+
+    if (ctx.baseline)
+        rb_netns_set_baseline(ctx.baseline, ctx.err ? -1 : ctx.baseline_len);
+
+    if (ctx.err) {
+        rb_unshare_nsset_close(set);
+        *step = ctx.step;
+        errno = ctx.err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* processes killed per /proc scan whose exit is awaited by pidfd */
+#define NSSET_KILL_BATCH	64
+
+/*
+ * SIGKILLs every process living in one of the namespaces of set and
+ * waits for them to exit by pidfd, without sleeping in between scans.
+ */
+static int nsset_kill(const struct rb_unshare_nsset *set)
+{
+    struct stat ns_st[UNSHARE_NS_COUNT], st;
+    int pidfds[NSSET_KILL_BATCH];
+    char path[PATH_MAX];
+    struct dirent *d;
+    int i, pass, found, npidfds, blind;
+    pid_t pid, self = getpid();
+    DIR *dir;
+
+    for (i = 0; i < UNSHARE_NS_COUNT; i++) {
+        if (set->fds[i] >= 0 && fstat(set->fds[i], &ns_st[i]) != 0)
+            return -1;
+    }
+
+    /* killed processes may have forked meanwhile, rescan until empty */
+    for (pass = 0; pass < 100; pass++) {
+        dir = opendir("/proc");
+        if (!dir)
+            return -1;
+
+        found = npidfds = blind = 0;
+        while ((d = readdir(dir))) {
+            pid = strtol(d->d_name, NULL, 10);
+            if (pid <= 0 || pid == self)
+                continue;
+
+            for (i = 0; i < UNSHARE_NS_COUNT; i++) {
+                if (set->fds[i] < 0)
+                    continue;
+
+                snprintf(path, sizeof(path), "/proc/%d/%s", pid, namespace_files[i].name);
+                /* fails for zombies, which have left their namespaces */
+                if (stat(path, &st) != 0)
+                    continue;
+                if (st.st_ino == ns_st[i].st_ino && st.st_dev == ns_st[i].st_dev)
+                    break;
+            }
+            if (i == UNSHARE_NS_COUNT)
+                continue;
+
+            found++;
+            if (rb_features.pidfd_open && npidfds < NSSET_KILL_BATCH &&
+                (pidfds[npidfds] = pidfd_open(pid, 0)) >= 0) {
+                pidfd_send_signal(pidfds[npidfds++], SIGKILL, NULL, 0);
+            } else {
+                kill(pid, SIGKILL);
+                blind++;
+            }
+        }
+        closedir(dir);
+
+        for (i = 0; i < npidfds; i++) {
+            rb_sync_wait_exit(pidfds[i], SYNC_TIMEOUT_MS);
+            close(pidfds[i]);
+        }
+
+        if (!found)
+            return 0;
+        /* no pidfd (old kernel or a full batch) to wait on */
+        if (blind)
+            xusleep(1000);
+    }
+
+    errno = EBUSY;
+    return -1;
+}
+
+#ifdef _SEM_SEMUN_UNDEFINED
+union semun {
+    int val;
+    struct semid_ds *buf;
+    unsigned short *array;
+    struct seminfo *__buf;
+};
+#endif
+
+/* removes all System V IPC objects of the current ipc namespace */
+static void ipc_flush(void)
+{
+    struct shm_info shm_info;
+    struct shmid_ds shmds;
+    struct seminfo seminfo;
+    struct semid_ds semds;
+    struct msginfo msginfo;
+    struct msqid_ds msgds;
+    union semun arg;
+    int i, max, id;
+
+    max = shmctl(0, SHM_INFO, (struct shmid_ds *) &shm_info);
+    for (i = 0; i <= max; i++) {
+        if ((id = shmctl(i, SHM_STAT, &shmds)) >= 0)
+            shmctl(id, IPC_RMID, NULL);
+    }
+
+    arg.__buf = &seminfo;
+    max = semctl(0, 0, SEM_INFO, arg);
+    arg.buf = &semds;
+    for (i = 0; i <= max; i++) {
+        if ((id = semctl(i, 0, SEM_STAT, arg)) >= 0)
+            semctl(id, 0, IPC_RMID);
+    }
+
+    max = msgctl(0, MSG_INFO, (struct msqid_ds *) &msginfo);
+    for (i = 0; i <= max; i++) {
+        if ((id = msgctl(i, MSG_STAT, &msgds)) >= 0)
+            msgctl(id, IPC_RMID, NULL);
+    }
+}
+
+static int nsset_fd(const struct rb_unshare_nsset *set, int type)
+{
+    int i;
+
+    for (i = 0; i < UNSHARE_NS_COUNT; i++) {
+        if (namespace_files[i].type == type)
+            return set->fds[i];
+    }
+    return -1;
+}
+
+static int nsset_reset_child(void *data)
+{
+    struct nsset_ctx *ctx = data;
+    int user = nsset_fd(ctx->set, CLONE_NEWUSER);
+    int mnt = nsset_fd(ctx->set, CLONE_NEWNS);
+    int ipc = nsset_fd(ctx->set, CLONE_NEWIPC);
+    int uts = nsset_fd(ctx->set, CLONE_NEWUTS);
+    int net = nsset_fd(ctx->set, CLONE_NEWNET);
+    int home = -1;
+    char host[HOST_NAME_MAX + 1];
+
+    /* devices that can not be deleted are moved back to our namespace */
+    if (net >= 0)
+        home = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+
+    if (user >= 0 && setns(user, CLONE_NEWUSER) != 0) {
+        ctx->step = _("setns failed");
+        goto fail;
+    }
+
+    if (mnt >= 0 && ctx->scratch) {
+        if (setns(mnt, CLONE_NEWNS) != 0) {
+            ctx->step = _("setns failed");
+            goto fail;
+        }
+        if (umount2(ctx->scratch, MNT_DETACH) != 0 || mount_scratch(ctx->scratch) != 0) {
+            ctx->step = _("cannot remount scratch");
+            goto fail;
+        }
+    }
+
+    if (ipc >= 0) {
+        if (setns(ipc, CLONE_NEWIPC) != 0) {
+            ctx->step = _("setns failed");
+            goto fail;
+        }
+        ipc_flush();
+    }
+
+    if (net >= 0) {
+        if (setns(net, CLONE_NEWNET) != 0) {
+            ctx->step = _("setns failed");
+            goto fail;
+        }
+        if (rb_netns_flush(home) != 0) {
+            ctx->step = _("cannot flush network namespace");
+            goto fail;
+        }
+    }
+
+    /* a new uts namespace starts with the hostname of its creator */
+    if (uts >= 0) {
+        if (gethostname(host, sizeof(host)) != 0 || setns(uts, CLONE_NEWUTS) != 0 ||
+            sethostname(host, strnlen(host, sizeof(host))) != 0) {
+            ctx->step = _("cannot reset hostname");
+            goto fail;
+        }
+    }
+
+    _exit(EXIT_SUCCESS);
+
+fail:
+    ctx->err = errno ?: EINVAL;
+    _exit(EXIT_FAILURE);
+}
+
+/*
+ * Brings the namespaces of set back to the state after creation: kills
+ * their processes, remounts the scratch tmpfs, removes System V IPC
+ * objects, flushes the network namespace (see rb_netns_flush()) and
+ * restores the hostname. Returns 0, or -1 with errno set and *step.
+ */
+int rb_unshare_nsset_reset(struct rb_unshare_nsset *set, const char *scratch,
+                           const char **step)
+{
+    struct nsset_ctx ctx = { .set = set, .scratch = scratch };
+    sigset_t old;
+    pid_t pid;
+
+    if (nsset_kill(set) != 0) {
+        *step = _("cannot kill namespace processes");
+        return -1;
+    }
+
+    pid = clone_vfork(nsset_reset_child, &ctx, 0, &old, NULL);
+    if (pid < 0) {
+        ctx.step = _("clone failed");
+        ctx.err = errno;
+    } else {
+        reap(pid);
+    }
+
+    if (ctx.err) {
+        *step = ctx.step;
+        errno = ctx.err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Registry support: namespaces are kept by bind mounts of their nsfs
+ * files on <dir>/<name>, like ip-netns(8) does in /run/netns.
+ */
+
+/*
+ * Makes dir a private mount point, otherwise a mount namespace bound
+ * below it could propagate into itself and the bind is refused.
+ */
+int rb_unshare_registry_prepare(const char *dir)
+{
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        return -1;
+    if (mount("none", dir, NULL, MS_PRIVATE, NULL) == 0)
+        return 0;
+    /* not a mount point yet */
+    if (errno != EINVAL || mount(dir, dir, NULL, MS_BIND, NULL) != 0)
+        return -1;
+
+    return mount("none", dir, NULL, MS_PRIVATE, NULL);
+}
+
+/* binds the namespaces pinned in set on <dir>/<name> */
+int rb_unshare_nsset_persist(const struct rb_unshare_nsset *set, const char *dir,
+                             const char **step)
+{
+    char src[PATH_MAX], path[PATH_MAX];
+    int i, fd;
+
+    for (i = 0; i < UNSHARE_NS_COUNT; i++) {
+        if (set->fds[i] < 0)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, rb_unshare_ns_name(i));
+        fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0444);
+        if (fd < 0) {
+            *step = _("cannot create bind target");
+            return -1;
+        }
+        close(fd);
+
+        snprintf(src, sizeof(src), "/proc/self/fd/%d", set->fds[i]);
+        if (mount(src, path, NULL, MS_BIND, NULL) != 0) {
+            *step = _("mount of namespace file failed");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Opens the namespace files bound in dir into set. Fails with ENOENT if
+ * there are none.
+ */
+int rb_unshare_nsset_open(struct rb_unshare_nsset *set, const char *dir)
+{
+    char path[PATH_MAX];
+    int i, found = 0;
+
+    for (i = 0; i < UNSHARE_NS_COUNT; i++) {
+        set->fds[i] = -1;
+
+        /* only ever bound by unshare, they need a process anyway */
+        if (namespace_files[i].type & (CLONE_NEWPID | CLONE_NEWTIME))
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, rb_unshare_ns_name(i));
+        set->fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+        if (set->fds[i] >= 0) {
+            found++;
+        } else if (errno != ENOENT) {
+            rb_unshare_nsset_close(set);
+            return -1;
+        }
+    }
+
+    if (!found) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+/* detaches the bind mounts of all namespace files in dir */
+int rb_unshare_unpersist(const char *dir)
+{
+    char path[PATH_MAX];
+    int i, rc = 0;
+
+    for (i = 0; i < UNSHARE_NS_COUNT; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, rb_unshare_ns_name(i));
+        if (umount2(path, MNT_DETACH) != 0 && errno != EINVAL && errno != ENOENT)
+            rc = -1;
+    }
+
+    return rc;
 }
@@ -2,6 +2,7 @@
 #define UNSHARE_H 1
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "include/c.h"
@@ -9,6 +10,51 @@
 #undef _
 # define _(Text) (Text)
 
+/* number of entries in the namespace_files table */
+#define UNSHARE_NS_COUNT	8
+
+/* namespaces pinned by nsfs fds, indexed like namespace_files, -1 unused */
+struct rb_unshare_nsset {
+    int fds[UNSHARE_NS_COUNT];
+};
+
+/* lines of uid_map and gid_map, the limit of kernels before 4.15 */
+#define UNSHARE_IDMAP_MAX	5
+
+/* a line of /proc/<pid>/uid_map: count ids from outer show up as inner */
+struct rb_unshare_idmap {
+    uint32_t inner;
+    uint32_t outer;
+    uint32_t count;
+};
+
+/* phases of the sandbox setup, see rb_unshare_phase_name() */
+enum {
+    UNSHARE_PHASE_TOTAL,	/* the whole call, in the caller */
+    UNSHARE_PHASE_HELPER,	/* start of the bind or id map helper */
+    UNSHARE_PHASE_UNSHARE,	/* unshare(2) and time namespace offsets */
+    UNSHARE_PHASE_CLONE,	/* clone(2) of spawn until the child runs */
+    UNSHARE_PHASE_FORK,
+    UNSHARE_PHASE_BIND,		/* bind mounts of persist */
+    UNSHARE_PHASE_IDMAP,	/* the child waits for uid_map and gid_map */
+    UNSHARE_PHASE_SETNS,	/* the child enters the nsset */
+    UNSHARE_PHASE_MAP_ID,
+    UNSHARE_PHASE_SETGROUPS,
+    UNSHARE_PHASE_PROPAGATION,
+    UNSHARE_PHASE_CHROOT,	/* chroot and chdir */
+    UNSHARE_PHASE_MOUNT_PROC,
+    UNSHARE_PHASE_CREDENTIALS,	/* setgroups, setgid and setuid */
+    UNSHARE_PHASE_CAPS,
+    UNSHARE_PHASE_EXEC,		/* execve(2) of spawn until the caller resumes */
+    UNSHARE_PHASE_COUNT
+};
+
+/* CLOCK_MONOTONIC nanoseconds spent in each phase that ran */
+struct rb_unshare_timings {
+    uint64_t ns[UNSHARE_PHASE_COUNT];
+    unsigned int ran;	/* bit per phase */
+};
+
 struct rb_unshare_args {
     bool clone_newuser;
     bool clone_newcgroup;
@@ -23,10 +69,10 @@ struct rb_unshare_args {
     bool wait;
 
     // default: /proc
-    VALUE mount_proc;
-    VALUE root;
+    const char *mount_proc;
+    const char *root;
 
-    VALUE new_dir;
+    const char *new_dir;
     bool map_root_user;
     bool map_current_user;
     uid_t map_user;
@@ -39,12 +85,50 @@ struct rb_unshare_args {
     bool force_boottime;
     bool force_monotonic;
     bool kill_child;
-};
 
-int rb_unshare_internal(struct rb_unshare_args args);
+    /* written by a helper in the parent user namespace (spawn only) */
+    struct rb_unshare_idmap uid_map[UNSHARE_IDMAP_MAX];
+    struct rb_unshare_idmap gid_map[UNSHARE_IDMAP_MAX];
+    int uid_map_len;
+    int gid_map_len;
+
+    /* entered by the spawned child after clone */
+    const struct rb_unshare_nsset *nsset;
+    /* nsset is a recycled network namespace standing in for clone_newnet */
+    bool netns_recycled;
+
+    /* directory to bind the new namespaces into (unshare only) */
+    const char *persist;
+
+    /* the caller passes a struct rb_unshare_timings to fill */
+    bool timings;
+};
 
-/* synchronize parent and child by pipe */
-#define PIPE_SYNC_BYTE	0x06
+int rb_unshare_prepare(struct rb_unshare_args *args, uid_t real_euid, gid_t real_egid);
+unsigned int rb_unshare_ns_set(const struct rb_unshare_args *args);
+int rb_unshare_internal(struct rb_unshare_args args, struct rb_unshare_timings *t,
+                        const char **step);
+pid_t rb_unshare_spawn_internal(struct rb_unshare_args args, char *const argv[],
+                                char *const envp[], struct rb_unshare_timings *t,
+                                const char **step);
+const char *rb_unshare_phase_name(int phase);
+
+const char *rb_unshare_ns_name(int idx);
+int rb_unshare_ns_type(int idx);
+int rb_unshare_setns_internal(pid_t pid, int pidfd, unsigned int mask, const char **step);
+int rb_unshare_nsset_create(struct rb_unshare_nsset *set, int flags,
+                            const char *scratch, const char **step);
+int rb_unshare_nsset_reset(struct rb_unshare_nsset *set, const char *scratch,
+                           const char **step);
+void rb_unshare_nsset_close(struct rb_unshare_nsset *set);
+int rb_unshare_nsset_enter(const struct rb_unshare_nsset *set, unsigned int mask,
+                           const char **step);
+
+int rb_unshare_registry_prepare(const char *dir);
+int rb_unshare_nsset_persist(const struct rb_unshare_nsset *set, const char *dir,
+                             const char **step);
+int rb_unshare_nsset_open(struct rb_unshare_nsset *set, const char *dir);
+int rb_unshare_unpersist(const char *dir);
 
 /* 'private' is kernel default */
 #define UNSHARE_PROPAGATION_DEFAULT	(MS_REC | MS_PRIVATE)
@@ -55,7 +139,7 @@ enum {
     SETGROUPS_ALLOW = 1,
 };
 
-static const char *setgroups_strings[] =
+static const char *setgroups_strings[] __attribute__((__unused__)) =
     {
         [SETGROUPS_DENY] = "deny",
         [SETGROUPS_ALLOW] = "allow"
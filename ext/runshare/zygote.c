@@ -0,0 +1,386 @@
+/*
+ * zygote - a small single-threaded helper forked from the ruby process
+ * early, before its heap grows. It takes spawn requests over a unix
+ * socket, builds the sandboxes with rb_unshare_spawn_internal() and
+ * returns pidfds of the children via SCM_RIGHTS. Neither fork() nor
+ * unshare() have to run in the (big, multithreaded) ruby process then.
+ * The sandboxes stay children of the zygote until the ruby process
+ * asks it to reap them, which returns their exit status and rusage.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "include/c.h"
+#include "include/pathnames.h"
+#include "include/pidfd-utils.h"
+
+#include "kfeatures.h"
+#include "sync.h"
+#include "zygote.h"
+
+enum {
+    ZYGOTE_SPAWN,
+    ZYGOTE_REAP,
+};
+
+/* optional strings of rb_unshare_args present in a request */
+enum {
+    ZYGOTE_MOUNT_PROC = 1 << 0,
+    ZYGOTE_ROOT       = 1 << 1,
+    ZYGOTE_NEW_DIR    = 1 << 2,
+};
+
+/* fixed part of a request, followed by size bytes of NUL terminated
+ * strings: the present optional paths, argv and envp */
+struct zygote_request {
+    uint32_t op;			/* ZYGOTE_SPAWN or ZYGOTE_REAP */
+    pid_t pid;				/* to reap */
+    struct rb_unshare_args args;	/* string pointers are not valid */
+    uint32_t strings;			/* ZYGOTE_* */
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t size;
+};
+
+/* upper bound for the strings of a single request */
+#define ZYGOTE_REQUEST_MAX	(16 * 1024 * 1024)
+
+static size_t pack_string(char *buf, size_t off, const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    if (buf)
+        memcpy(buf + off, str, len);
+    return off + len;
+}
+
+/* computes the size of the strings with buf == NULL, fills buf otherwise */
+static size_t pack_strings(char *buf, const struct rb_unshare_args *args,
+                           char *const argv[], char *const envp[])
+{
+    size_t off = 0;
+    char *const *p;
+
+    if (args->mount_proc)
+        off = pack_string(buf, off, args->mount_proc);
+    if (args->root)
+        off = pack_string(buf, off, args->root);
+    if (args->new_dir)
+        off = pack_string(buf, off, args->new_dir);
+    for (p = argv; *p; p++)
+        off = pack_string(buf, off, *p);
+    for (p = envp; *p; p++)
+        off = pack_string(buf, off, *p);
+
+    return off;
+}
+
+int rb_zygote_send(int sock, const struct rb_unshare_args *args,
+                   char *const argv[], char *const envp[])
+{
+    struct zygote_request req = { .op = ZYGOTE_SPAWN, .args = *args };
+    char *const *p;
+    size_t size;
+    char *buf;
+    int rc;
+
+    req.args.mount_proc = req.args.root = req.args.new_dir = NULL;
+    req.args.nsset = NULL;
+    if (args->mount_proc)
+        req.strings |= ZYGOTE_MOUNT_PROC;
+    if (args->root)
+        req.strings |= ZYGOTE_ROOT;
+    if (args->new_dir)
+        req.strings |= ZYGOTE_NEW_DIR;
+    for (p = argv; *p; p++)
+        req.argc++;
+    for (p = envp; *p; p++)
+        req.envc++;
+
+    size = pack_strings(NULL, args, argv, envp);
+    if (size > ZYGOTE_REQUEST_MAX) {
+        errno = E2BIG;
+        return -1;
+    }
+    req.size = size;
+
+    buf = malloc(sizeof(req) + size);
+    if (!buf)
+        return -1;
+    memcpy(buf, &req, sizeof(req));
+    pack_strings(buf + sizeof(req), args, argv, envp);
+
+    rc = rb_sync_write(sock, buf, sizeof(req) + size, SYNC_TIMEOUT_MS);
+    free(buf);
+    return rc;
+}
+
+/* asks the zygote for the exit of pid, which it spawned */
+int rb_zygote_send_reap(int sock, pid_t pid)
+{
+    struct zygote_request req = { .op = ZYGOTE_REAP, .pid = pid };
+
+    return rb_sync_write(sock, &req, sizeof(req), SYNC_TIMEOUT_MS);
+}
+
+int rb_zygote_recv(int sock, struct zygote_reply *reply, int *pidfd)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    struct iovec iov = { .iov_base = reply, .iov_len = sizeof(*reply) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = u.buf,
+        .msg_controllen = sizeof(u.buf),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    *pidfd = -1;
+
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return -1;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(pidfd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    /* the fd comes with the first byte, the rest may lag behind */
+    if (n > 0 && (size_t) n < sizeof(*reply) &&
+        rb_sync_read(sock, (char *) reply + n, sizeof(*reply) - n, SYNC_TIMEOUT_MS) ==
+        (ssize_t) (sizeof(*reply) - n))
+        n = sizeof(*reply);
+
+    if ((size_t) n != sizeof(*reply)) {
+        if (*pidfd >= 0)
+            close(*pidfd);
+        *pidfd = -1;
+        errno = n < 0 ? errno : EPIPE;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int zygote_reply(int sock, const struct zygote_reply *reply, int pidfd)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    struct iovec iov = { .iov_base = (void *) reply, .iov_len = sizeof(*reply) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    struct cmsghdr *cmsg;
+
+    if (pidfd >= 0) {
+        msg.msg_control = u.buf;
+        msg.msg_controllen = sizeof(u.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &pidfd, sizeof(int));
+    }
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(*reply) ? 0 : -1;
+}
+
+static char *unpack_string(char **p, char *end)
+{
+    char *str = *p;
+    size_t len = strnlen(str, end - str);
+
+    if (str + len == end)
+        return NULL;
+    *p = str + len + 1;
+    return str;
+}
+
+static char **unpack_strings(char **p, char *end, uint32_t n)
+{
+    char **res = calloc(n + 1, sizeof(char *));
+    uint32_t i;
+
+    if (!res)
+        return NULL;
+    for (i = 0; i < n; i++) {
+        if (!(res[i] = unpack_string(p, end))) {
+            free(res);
+            return NULL;
+        }
+    }
+    return res;
+}
+
+static void zygote_serve(int sock, struct zygote_request *req, char *buf)
+{
+    struct zygote_reply reply = { .pid = -1 };
+    char *p = buf, *end = buf + req->size;
+    char **argv = NULL, **envp = NULL;
+    const char *step = _("malformed request");
+    int pidfd = -1;
+
+    if ((req->strings & ZYGOTE_MOUNT_PROC) && !(req->args.mount_proc = unpack_string(&p, end)))
+        goto done;
+    if ((req->strings & ZYGOTE_ROOT) && !(req->args.root = unpack_string(&p, end)))
+        goto done;
+    if ((req->strings & ZYGOTE_NEW_DIR) && !(req->args.new_dir = unpack_string(&p, end)))
+        goto done;
+    if (req->argc < 1 ||
+        !(argv = unpack_strings(&p, end, req->argc)) ||
+        !(envp = unpack_strings(&p, end, req->envc)))
+        goto done;
+
+    /* nothing reaps the child before the ruby process asks for it */
+    reply.pid = rb_unshare_spawn_internal(req->args, argv, envp, NULL, &step);
+    if (reply.pid < 0)
+        reply.err = errno;
+    else
+        pidfd = pidfd_open(reply.pid, 0);
+
+done:
+    if (reply.pid < 0) {
+        reply.err = reply.err ?: EINVAL;
+        snprintf(reply.step, sizeof(reply.step), "%s", step);
+    }
+    if (zygote_reply(sock, &reply, pidfd) < 0)
+        _exit(EXIT_FAILURE);
+    if (pidfd >= 0)
+        close(pidfd);
+    free(argv);
+    free(envp);
+}
+
+/*
+ * Reaps a sandbox the ruby process saw exit on its pidfd. It never
+ * blocks, a sandbox still running is answered with pid 0. Only our own
+ * children can be reaped, the helpers of a spawn are gone by now.
+ */
+static void zygote_reap(int sock, pid_t pid)
+{
+    struct zygote_reply reply = { .pid = -1 };
+
+    if (pid <= 0) {
+        reply.err = ECHILD;
+    } else {
+        reply.pid = wait4(pid, &reply.status, WNOHANG, &reply.ru);
+        if (reply.pid < 0)
+            reply.err = errno;
+    }
+    if (reply.pid < 0)
+        snprintf(reply.step, sizeof(reply.step), "%s", _("wait4 failed"));
+
+    if (zygote_reply(sock, &reply, -1) < 0)
+        _exit(EXIT_FAILURE);
+}
+
+/* the zygote must not keep the ruby process sockets and files alive */
+static void close_fds_except(int keep)
+{
+    DIR *dir;
+    struct dirent *d;
+    int fd;
+
+    if (rb_features.close_range &&
+        (keep <= STDERR_FILENO + 1 ||
+         syscall(SYS_close_range, STDERR_FILENO + 1, keep - 1, 0) == 0) &&
+        syscall(SYS_close_range, keep + 1, ~0U, 0) == 0)
+        return;
+
+    dir = opendir(_PATH_PROC_FDDIR);
+    if (!dir)
+        return;
+    while ((d = readdir(dir))) {
+        fd = atoi(d->d_name);
+        if (fd > STDERR_FILENO && fd != keep && fd != dirfd(dir))
+            close(fd);
+    }
+    closedir(dir);
+}
+
+static void __attribute__((__noreturn__)) zygote_main(int sock)
+{
+    struct sigaction sa = { .sa_handler = SIG_DFL };
+    struct zygote_request req;
+    sigset_t none;
+    char *buf;
+    int sig;
+
+    /* nothing of the ruby process runs here anymore */
+    for (sig = 1; sig < NSIG; sig++)
+        sigaction(sig, &sa, NULL);
+
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    prctl(PR_SET_NAME, "runshare-zygote", 0, 0, 0);
+    close_fds_except(sock);
+
+    for (;;) {
+        /* EOF: the ruby process closed the zygote or went away */
+        if (rb_sync_read(sock, &req, sizeof(req), -1) != sizeof(req))
+            _exit(EXIT_SUCCESS);
+        if (req.op == ZYGOTE_REAP) {
+            zygote_reap(sock, req.pid);
+            continue;
+        }
+        if (req.op != ZYGOTE_SPAWN || req.size > ZYGOTE_REQUEST_MAX)
+            _exit(EXIT_FAILURE);
+
+        buf = malloc(req.size ?: 1);
+        if (!buf || rb_sync_read(sock, buf, req.size, SYNC_TIMEOUT_MS) != (ssize_t) req.size)
+            _exit(EXIT_FAILURE);
+
+        zygote_serve(sock, &req, buf);
+        free(buf);
+    }
+}
+
+/*
+ * Forks the zygote. Returns its pid and the socket to talk to it,
+ * or -1 with errno set.
+ */
+pid_t rb_zygote_start(int *sock)
+{
+    int sv[2], e;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+
+    pid = fork();
+    switch (pid) {
+        case -1:
+            e = errno;
+            close(sv[0]);
+            close(sv[1]);
+            errno = e;
+            return -1;
+
+        case 0: /* zygote */
+            close(sv[0]);
+            zygote_main(sv[1]);
+
+        default:
+            close(sv[1]);
+            *sock = sv[0];
+            return pid;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H 1
+
+#include <sys/resource.h>
+
+#include "unshare.h"
+
+/*
+ * Answer to a request. A spawn comes with the pidfd of the sandbox in
+ * SCM_RIGHTS; a reap with the wait4(2) results, pid is 0 then while
+ * the sandbox still runs.
+ */
+struct zygote_reply {
+    pid_t pid;		/* -1 if the request failed */
+    int err;		/* errno of the failed step */
+    char step[64];	/* what failed */
+    int status;		/* of a reaped sandbox */
+    struct rusage ru;
+};
+
+pid_t rb_zygote_start(int *sock);
+int rb_zygote_send(int sock, const struct rb_unshare_args *args,
+                   char *const argv[], char *const envp[]);
+int rb_zygote_send_reap(int sock, pid_t pid);
+int rb_zygote_recv(int sock, struct zygote_reply *reply, int *pidfd);
+
+#endif
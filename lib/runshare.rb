@@ -1,7 +1,22 @@
 require "runshare/version"
 require "runshare/runshare"
+require "runshare/child"
+require "runshare/result"
+require "runshare/fork_server"
+require "runshare/pool"
+require "runshare/registry"
+require "runshare/id_pool"
+require "runshare/metrics"
+require "runshare/namespace_threads"
 
 module RUnshare
-  class Error < StandardError; end
-  # Your code goes here...
+  # Starts the process wide zygote, see RUnshare::Zygote.
+  # Call it early, before the application is loaded.
+  def self.start_zygote
+    @zygote ||= Zygote.new
+  end
+
+  def self.zygote
+    @zygote
+  end
 end
@@ -0,0 +1,159 @@
+require "io/wait"
+
+module RUnshare
+  # A child process started by RUnshare.unshare, RUnshare.spawn or a
+  # Zygote. It holds a pidfd, an IO that becomes readable when the child
+  # exits, so many children can be watched from one IO.select or Fiber
+  # scheduler loop. Signals go through the pidfd and can not hit a reused pid.
+  #
+  # It compares equal to the pid and converts to it, so it can be passed
+  # where a pid is expected:
+  #
+  #   child = RUnshare.spawn(["/bin/sleep", "1"])
+  #   child.to_io.wait_readable
+  #   child.wait # => #<RUnshare::Result pid 1234 exit 0 utime=0.0 stime=0.001 maxrss=1884160>
+  class Child
+    include Comparable
+
+    attr_reader :pid, :status
+
+    # seconds spent in each phase of the setup with timings: true, e.g.
+    # {:clone=>0.0002, :mount_proc=>0.0011, :exec=>0.0004, :total=>0.0019}
+    attr_reader :timings
+
+    # the IdPool::Range of the child, released once it is reaped
+    attr_accessor :id_range
+
+    # resident bytes of a child of unshare with :fork when it was set
+    # up, all of them shared with the parent then; nil for spawn
+    attr_reader :rss_at_fork
+
+    # fields of smaps_rollup reported by memory_stats
+    SMAPS_FIELDS = {
+      "Rss" => :rss, "Pss" => :pss, "Shared_Clean" => :shared_clean,
+      "Shared_Dirty" => :shared_dirty, "Private_Clean" => :private_clean,
+      "Private_Dirty" => :private_dirty, "Swap" => :swap,
+    }.freeze
+
+    # pidfd is opened for pid if not given. The sandboxes of a Zygote
+    # are its children, it is the reaper that reaps them then.
+    def initialize(pid, pidfd = nil, reaper = nil)
+      @pid = pid
+      @pidfd = pidfd || RUnshare.pidfd_open(pid)
+      @reaper = reaper
+      @status = nil
+      @timings = nil
+      @rss_at_fork = nil
+      @smaps = nil
+    end
+
+    def to_io
+      @pidfd
+    end
+
+    def to_i
+      @pid
+    end
+    alias to_int to_i
+
+    def <=>(other)
+      @pid <=> (other.is_a?(Child) ? other.pid : other)
+    end
+
+    def ==(other)
+      other.is_a?(Child) ? @pid == other.pid : @pid == other
+    end
+    alias eql? ==
+
+    def hash
+      @pid.hash
+    end
+
+    def to_s
+      @pid.to_s
+    end
+
+    def inspect
+      "#<#{self.class.name} pid=#{@pid}#{@status ? " #{@status.inspect}" : ""}>"
+    end
+
+    def kill(sig = :TERM)
+      signo = sig.is_a?(Integer) ? sig : Signal.list.fetch(sig.to_s.sub(/\ASIG/, ""))
+      RUnshare.pidfd_send_signal(@pidfd, signo)
+    end
+
+    # Memory of the child in bytes from /proc/<pid>/smaps_rollup, which
+    # stays open for cheap rereads and is reopened after an exec: rss, pss, uss (private_clean +
+    # private_dirty), shared_clean, shared_dirty, private_clean,
+    # private_dirty and swap. For a child of unshare with :fork also
+    # rss_growth, the resident memory added since fork, and
+    # unshared_since_fork, the pages shared at fork that are not any
+    # more, mostly broken copy-on-write. nil once the child is gone.
+    #
+    # Needs ptrace read access to the child, which a child that changed
+    # its uid with set_uid does not give.
+    def memory_stats
+      return nil if @status
+
+      stats = read_smaps
+      if stats.empty?
+        # the open file keeps the mm of before an exec, which is gone
+        @smaps.close
+        @smaps = nil
+        stats = read_smaps
+      end
+      return nil if stats.empty?
+
+      stats[:uss] = stats[:private_clean] + stats[:private_dirty]
+      if @rss_at_fork
+        stats[:rss_growth] = stats[:rss] - @rss_at_fork
+        stats[:unshared_since_fork] = [@rss_at_fork - stats[:shared_clean] - stats[:shared_dirty], 0].max
+      end
+      stats
+    rescue Errno::ESRCH, Errno::ENOENT, EOFError
+      nil
+    end
+
+    def exited?
+      !@status.nil? || !@pidfd.wait_readable(0).nil?
+    end
+
+    # Waits up to timeout seconds (forever if nil) for the child to exit
+    # and reaps it. Returns the RUnshare::Result, exit status and
+    # resource use, or nil on timeout. Under a Fiber scheduler the wait
+    # goes through the pidfd, so other fibers go on meanwhile. A reaper
+    # is asked only once the child has exited.
+    def wait(timeout = nil)
+      return @status if @status
+      if timeout || Fiber.scheduler || @reaper
+        return nil if @pidfd.wait_readable(timeout).nil?
+      end
+
+      # counts into RUnshare.metrics
+      @status = (@reaper || RUnshare).reap(@pid)
+      return nil unless @status
+
+      @pidfd.close
+      @smaps&.close
+      @smaps = nil
+      RUnshare.netns_release(@pid)
+      @id_range&.release
+      @status
+    end
+
+    private
+
+    def read_smaps
+      @smaps ||= File.open("/proc/#{@pid}/smaps_rollup")
+      stats = {}
+      @smaps.pread(4096, 0).each_line do |l|
+        name, kb = l.split(":", 2)
+        key = SMAPS_FIELDS[name]
+        stats[key] = kb.to_i * 1024 if key
+      end
+      stats
+    rescue Errno::ESRCH, EOFError
+      {}
+    end
+  end
+end
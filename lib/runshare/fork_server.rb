@@ -0,0 +1,182 @@
+require "socket"
+
+module RUnshare
+  # A long-lived process inside new namespaces that forks one child per
+  # job. The namespaces (unshare, id maps, /proc, root) are set up once
+  # per server, and the preload file is loaded once, before they are
+  # entered, so jobs start with the application code already in memory.
+  #
+  #   # jobs.rb
+  #   RUnshare::ForkServer.job { |name| puts "hello #{name}" }
+  #
+  #   server = RUnshare::ForkServer.new("jobs.rb", :clone_newpid => true, :mount_proc => "/proc")
+  #   pid = server.run("world")
+  #   server.wait(pid) # => 0
+  #   server.close
+  #
+  # The server runs inside the sandbox, so nothing it sends is loaded
+  # as objects: its frames are a tag, a pid and a value packed as
+  # integers, an error message follows as a string of value bytes.
+  class ForkServer
+    # tags of the frames from the server
+    STARTED = 1 # pid of the job
+    EXIT = 2    # pid of the job, exit status or -1 when killed by a signal
+    ERROR = 3   # errno in place of the pid, message of value bytes follows
+
+    FRAME = "NNl>".freeze
+    FRAME_SIZE = 12
+    ERROR_MAX = 4096
+
+    # pid of the process holding the server, as seen by the caller
+    attr_reader :pid
+
+    # Registers the block run by every job. Called from the preload file.
+    def self.job(&block)
+      @job = block
+    end
+
+    def self.job_handler
+      @job
+    end
+
+    def initialize(preload = nil, **opts)
+      @sock, theirs = UNIXSocket.pair
+      @run_lock = Mutex.new
+      @lock = Mutex.new
+      @started = Queue.new
+      @jobs = {}
+      @failure = nil
+
+      @pid = Process.fork do
+        @sock.close
+        load preload if preload
+
+        # the server must not outlive the process the caller waits for
+        if RUnshare.unshare(**opts, :kill_child => true, :wait => true) != 0
+          exit!(0)
+        end
+
+        serve(theirs)
+      end
+
+      theirs.close
+      @reader = Thread.new { read_frames }
+      @reader.report_on_exception = false
+    end
+
+    # Forks a job with args passed to the registered block.
+    # Returns its pid within the server namespaces.
+    def run(*args)
+      @run_lock.synchronize do
+        write_message(@sock, args)
+        res = @started.pop
+        raise closed_error if res.nil?
+        raise res if res.is_a?(Exception)
+
+        res
+      end
+    end
+
+    # Waits for the job and returns its exit status,
+    # nil if it was killed by a signal. Jobs are waited for
+    # independently, a long one does not hold up the others.
+    def wait(job)
+      exits = @lock.synchronize { @jobs[job] }
+      raise ArgumentError, "unknown job #{job}" unless exits
+
+      res = exits.pop
+      raise closed_error if res.nil?
+
+      @lock.synchronize { @jobs.delete(job) if @jobs[job].equal?(exits) }
+      res[0]
+    end
+
+    # Stops the server; jobs still running are left alone unless
+    # the server owns their pid namespace.
+    def close
+      return if @sock.closed?
+
+      @sock.close
+      @reader.join
+      Process.waitpid(@pid)
+    end
+
+    private
+
+    def closed_error
+      @failure || EOFError.new("fork server exited")
+    end
+
+    # hands the frames of the server to run and wait until it goes away
+    def read_frames
+      loop do
+        frame = @sock.read(FRAME_SIZE)
+        break if frame.nil? || frame.bytesize < FRAME_SIZE
+
+        tag, pid, value = frame.unpack(FRAME)
+        case tag
+        when STARTED
+          @lock.synchronize { @jobs[pid] = Queue.new }
+          @started.push(pid)
+        when EXIT
+          exits = @lock.synchronize { @jobs[pid] }
+          exits&.push([value < 0 ? nil : value])
+        when ERROR
+          raise IOError, "fork server sent a bad frame" unless value.between?(0, ERROR_MAX)
+
+          msg = @sock.read(value).to_s.dup.force_encoding(Encoding::UTF_8).scrub
+          @started.push(SystemCallError.new("fork server: #{msg}", pid))
+        else
+          raise IOError, "fork server sent a bad frame"
+        end
+      end
+    rescue IOError, SystemCallError => e
+      @failure = e unless @sock.closed?
+    ensure
+      @started.close
+      @lock.synchronize { @jobs.each_value(&:close) }
+    end
+
+    def serve(sock)
+      lock = Mutex.new
+
+      while (args = read_message(sock))
+        begin
+          job = Process.fork do
+            sock.close
+            self.class.job_handler.call(*args)
+          end
+        rescue SystemCallError => e
+          msg = e.message.b[0, ERROR_MAX]
+          lock.synchronize { sock.write([ERROR, e.errno, msg.bytesize].pack(FRAME), msg) }
+          next
+        end
+        lock.synchronize { sock.write([STARTED, job, 0].pack(FRAME)) }
+
+        Thread.new(job) do |pid|
+          _, status = Process.wait2(pid)
+          lock.synchronize { sock.write([EXIT, pid, status.exitstatus || -1].pack(FRAME)) }
+        end
+      end
+    ensure
+      exit!(0)
+    end
+
+    # the job arguments, from the caller to the server only
+    def write_message(sock, msg)
+      data = Marshal.dump(msg)
+      sock.write([data.bytesize].pack("N"), data)
+    end
+
+    def read_message(sock)
+      size = sock.read(4)
+      return nil if size.nil?
+
+      Marshal.load(sock.read(size.unpack1("N")))
+    end
+  end
+
+  def self.fork_server(preload = nil, **opts)
+    ForkServer.new(preload, **opts)
+  end
+end
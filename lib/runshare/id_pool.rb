@@ -0,0 +1,124 @@
+module RUnshare
+  # Hands out disjoint ranges of subordinate ids, so every sandbox gets
+  # its own uids and gids. The pool state is a file with one record per
+  # range, locked with flock, so processes sharing the file share the
+  # pool. A record holds the process using the range; ranges of
+  # processes that are gone are reused.
+  #
+  #   pool = RUnshare::IdPool.new("/run/runshare/ids", 100000, 65536 * 64)
+  #   child = pool.spawn(["/bin/sh"], :clone_newpid => true)
+  #   child.wait # releases the range
+  #
+  # Without CAP_SETUID the ranges have to be granted to the user in
+  # /etc/subuid and /etc/subgid, newuidmap(1) writes them.
+  class IdPool
+    # ids first...first + count of the pool, in record slot
+    class Range
+      attr_reader :pool, :slot, :first, :count
+
+      def initialize(pool, slot, first, count)
+        @pool = pool
+        @slot = slot
+        @first = first
+        @count = count
+      end
+
+      # uid_map and gid_map mapping the range to 0... in the sandbox
+      def map
+        [[0, @first, @count]]
+      end
+
+      def release
+        @pool.release(self)
+      end
+    end
+
+    # pid and start time of the user, 0 for a free range
+    RECORD = "L<Q<".freeze
+    RECORD_SIZE = 12
+
+    attr_reader :path, :first, :count, :size
+
+    def initialize(path, first, count, size = 65536)
+      raise ArgumentError, "pool of #{count} ids has no range of #{size}" if size < 1 || count < size
+
+      @path = path
+      @first = first
+      @count = count
+      @size = size
+    end
+
+    def slots
+      @count / @size
+    end
+
+    # Takes a free range for owner, raises Errno::ENOSPC when none is left.
+    def allocate(owner = Process.pid)
+      locked do |f|
+        slot = (0...slots).find { |i| !used?(read(f, i)) }
+        raise Errno::ENOSPC, "no free id range in #{@path}" unless slot
+
+        write(f, slot, owner)
+        Range.new(self, slot, @first + slot * @size, @size)
+      end
+    end
+
+    # Hands range over to pid, the sandbox it was allocated for.
+    def assign(range, pid)
+      locked { |f| write(f, range.slot, pid) }
+    end
+
+    def release(range)
+      locked { |f| f.pwrite([0, 0].pack(RECORD), range.slot * RECORD_SIZE) }
+      nil
+    end
+
+    # number of ranges in use
+    def used
+      locked { |f| (0...slots).count { |i| used?(read(f, i)) } }
+    end
+
+    # Like RUnshare.spawn in a new user namespace with a range of its own
+    # mapped to root. The range is released by Child#wait.
+    def spawn(cmd, **opts)
+      range = allocate
+      begin
+        child = RUnshare.spawn(cmd, **opts, :uid_map => range.map, :gid_map => range.map, :wait => false)
+      rescue StandardError
+        release(range)
+        raise
+      end
+
+      assign(range, child.pid)
+      child.id_range = range
+      child.wait if opts[:wait]
+      child
+    end
+
+    private
+
+    def locked
+      File.open(@path, File::RDWR | File::CREAT, 0600) do |f|
+        f.flock(File::LOCK_EX)
+        yield f
+      end
+    end
+
+    def read(f, slot)
+      data = f.pread(RECORD_SIZE, slot * RECORD_SIZE)
+      data && data.bytesize == RECORD_SIZE ? data.unpack(RECORD) : [0, 0]
+    rescue EOFError
+      [0, 0]
+    end
+
+    def write(f, slot, pid)
+      f.pwrite([pid, Registry.start_time(pid) || 0].pack(RECORD), slot * RECORD_SIZE)
+    end
+
+    # the pid may have been reused, the start time tells
+    def used?(record)
+      pid, start = record
+      pid != 0 && Registry.start_time(pid) == start
+    end
+  end
+end
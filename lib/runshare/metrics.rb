@@ -0,0 +1,79 @@
+module RUnshare
+  # Renders RUnshare.metrics in the Prometheus text exposition format,
+  # e.g. from a Rack endpoint:
+  #
+  #   get "/metrics" do
+  #     [200, { "content-type" => RUnshare::Metrics::CONTENT_TYPE }, [RUnshare::Metrics.render]]
+  #   end
+  #
+  # live_children counts the children created and not reaped by
+  # Child#wait or RUnshare.reap yet.
+  module Metrics
+    CONTENT_TYPE = "text/plain; version=0.0.4".freeze
+
+    class << self
+      def render(snapshot = RUnshare.metrics)
+        out = +""
+
+        header(out, "runshare_sandboxes_created_total", "counter",
+               "Sandboxes created, by the set of new namespaces")
+        snapshot[:created].each do |set, n|
+          sample(out, "runshare_sandboxes_created_total", { namespaces: set.join(",") }, n)
+        end
+
+        header(out, "runshare_setup_failures_total", "counter",
+               "Failed sandbox setups, by step and errno")
+        snapshot[:failed].each do |(step, err), n|
+          sample(out, "runshare_setup_failures_total",
+                 { step: step || "other", errno: errno_name(err) }, n)
+        end
+
+        header(out, "runshare_create_duration_seconds", "histogram",
+               "Time to create a sandbox, spawn until execve, fork until set up")
+        snapshot[:create_seconds].each do |path, h|
+          histogram(out, "runshare_create_duration_seconds", { path: path }, h)
+        end
+
+        header(out, "runshare_wait_duration_seconds", "histogram",
+               "Time spent in waitpid reaping sandboxes")
+        histogram(out, "runshare_wait_duration_seconds", {}, snapshot[:wait_seconds])
+
+        header(out, "runshare_live_children", "gauge", "Sandboxes created and not reaped")
+        sample(out, "runshare_live_children", {}, snapshot[:live_children])
+
+        out
+      end
+
+      private
+
+      def header(out, name, type, help)
+        out << "# HELP #{name} #{help}\n# TYPE #{name} #{type}\n"
+      end
+
+      def histogram(out, name, labels, h)
+        h[:buckets].each do |le, n|
+          sample(out, "#{name}_bucket", labels.merge(le: le.infinite? ? "+Inf" : le.to_s), n)
+        end
+        sample(out, "#{name}_sum", labels, h[:sum])
+        sample(out, "#{name}_count", labels, h[:count])
+      end
+
+      def sample(out, name, labels, value)
+        out << name
+        unless labels.empty?
+          out << "{" << labels.map { |k, v| "#{k}=\"#{escape(v.to_s)}\"" }.join(",") << "}"
+        end
+        out << " " << value.to_s << "\n"
+      end
+
+      def escape(s)
+        s.gsub(/[\\"\n]/, "\\" => "\\\\", "\"" => "\\\"", "\n" => "\\n")
+      end
+
+      def errno_name(err)
+        klass = SystemCallError.new(nil, err).class
+        klass == SystemCallError ? err.to_s : klass.name.sub("Errno::", "")
+      end
+    end
+  end
+end
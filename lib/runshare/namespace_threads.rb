@@ -0,0 +1,144 @@
+module RUnshare
+  # Native threads that run blocks inside namespaces of other processes,
+  # see RUnshare.in_namespace. A worker joins the namespaces for a call
+  # and goes back to those of the process afterwards, so an idle worker
+  # does not keep a sandbox alive. Workers are started on demand and
+  # reused; up to size of them run at once, more calls wait for one.
+  #
+  # setns(2) applies to the native thread, so this needs ruby threads
+  # backed by their own native threads (the default, not RUBY_MN_THREADS).
+  class NamespaceThreads
+    attr_reader :size
+
+    def initialize(size = 4)
+      @size = size
+      @idle = Queue.new
+      @lock = Mutex.new
+      @workers = []
+      @closed = false
+    end
+
+    # Runs the block in the namespaces of types (:net, :mnt, :uts, :ipc,
+    # :cgroup...) of target, a pid, pidfd IO or NamespaceSet, and returns
+    # its value. Exceptions are raised in the caller. In a mount namespace
+    # the block starts in its root directory.
+    def run(target, *types, &block)
+      raise ArgumentError, "no block given" unless block
+      raise ArgumentError, "user namespaces can not be joined by a thread" if types.include?(:user)
+
+      opts = types.map { |type| [type.to_sym, true] }.to_h
+      result = Queue.new
+      begin
+        checkout << [target, opts, block, result]
+      rescue ClosedQueueError
+        raise closed_error
+      end
+
+      kind, value = result.pop
+      raise value if kind == :error
+      value
+    end
+
+    def closed?
+      @closed
+    end
+
+    # Stops the workers once they finished their calls. Later calls
+    # raise IOError, as do those still waiting for a worker.
+    def close
+      workers = @lock.synchronize do
+        @closed = true
+        @idle.clear
+        @idle.close
+        @workers.each { |worker| worker[:inbox].close }
+        @workers.slice!(0..)
+      end
+      # outside the lock, a worker may be retiring
+      workers.each(&:join)
+    end
+
+    private
+
+    def closed_error
+      IOError.new("namespace threads closed")
+    end
+
+    # inbox of an idle worker
+    def checkout
+      begin
+        return @idle.pop(true)[:inbox]
+      rescue ThreadError
+      end
+
+      @lock.synchronize do
+        raise closed_error if @closed
+
+        if @workers.size < @size
+          worker = start_worker
+          @workers << worker
+          return worker[:inbox]
+        end
+      end
+
+      worker = @idle.pop
+      raise closed_error unless worker
+
+      worker[:inbox]
+    end
+
+    def start_worker
+      inbox = Queue.new
+      worker = Thread.new { work(inbox) }
+      worker[:inbox] = inbox
+      worker
+    end
+
+    def work(inbox)
+      while (job = inbox.pop)
+        target, opts, block, result = job
+
+        begin
+          RUnshare.setns(target, **opts)
+          result << [:ok, block.call]
+        rescue Exception => e
+          result << [:error, e]
+        end
+
+        begin
+          RUnshare.setns(Process.pid, **opts)
+        rescue SystemCallError
+          # stuck in foreign namespaces, replace this worker
+          retire
+          return
+        end
+
+        begin
+          @idle << Thread.current
+        rescue ClosedQueueError
+          return
+        end
+      end
+    end
+
+    def retire
+      @lock.synchronize do
+        @workers.delete(Thread.current)
+        return if @closed
+
+        worker = start_worker
+        @workers << worker
+        @idle << worker
+      end
+    end
+  end
+
+  # Runs the block on a pooled thread inside namespaces of target, without
+  # forking, see RUnshare::NamespaceThreads:
+  #
+  #   RUnshare.in_namespace(pid, :net) { TCPSocket.new("127.0.0.1", 8080) }
+  def self.in_namespace(target, *types, &block)
+    @namespace_threads = nil if @namespace_threads&.closed?
+    @namespace_threads ||= NamespaceThreads.new
+    @namespace_threads.run(target, *types, &block)
+  end
+end
@@ -0,0 +1,66 @@
+module RUnshare
+  # Keeps namespace sets (see RUnshare::NamespaceSet) created ahead of
+  # time, so taking one costs no namespace creation on the request path.
+  # Returned sets are reset and reused; a background thread tops the
+  # pool up when sets are taken out or dropped.
+  #
+  #   pool = RUnshare::Pool.new(4, :clone_newnet => true, :clone_newns => true, :scratch => "/tmp")
+  #   pool.with do |set|
+  #     RUnshare.spawn(["/bin/true"], :nsset => set).wait
+  #   end
+  class Pool
+    attr_reader :size
+
+    def initialize(size = 4, **opts)
+      @size = size
+      @opts = opts
+      @idle = Queue.new
+      @wanted = Queue.new
+
+      size.times { @idle << NamespaceSet.new(**opts) }
+
+      @filler = Thread.new do
+        while @wanted.pop
+          @idle << NamespaceSet.new(**@opts) if @idle.size < @size
+        end
+      end
+    end
+
+    # Takes a set out of the pool, creating one if the pool is empty.
+    def checkout
+      set = begin
+        @idle.pop(true)
+      rescue ThreadError
+        NamespaceSet.new(**@opts)
+      end
+      @wanted << true unless @wanted.closed?
+      set
+    end
+
+    # Resets the set and puts it back; a set that can not be reset
+    # is dropped.
+    def checkin(set)
+      set.reset
+      if @idle.size < @size && !@wanted.closed?
+        @idle << set
+      else
+        set.close
+      end
+    rescue SystemCallError
+      set.close
+    end
+
+    def with
+      set = checkout
+      yield set
+    ensure
+      checkin(set) if set
+    end
+
+    def close
+      @wanted.close
+      @filler.join
+      @idle.pop.close until @idle.empty?
+    end
+  end
+end
@@ -0,0 +1,103 @@
+module RUnshare
+  # Keeps namespaces by bind mounts of their files under
+  # Registry.dir/<name>, so they outlive the processes in them and can
+  # be entered by name later. Each entry records the process that owns
+  # it; gc removes the entries whose owner is gone.
+  #
+  #   RUnshare::Registry.register("web", RUnshare::NamespaceSet.new(:clone_newnet => true))
+  #   set = RUnshare::Registry.open("web")
+  #   RUnshare.spawn(["/bin/true"], :nsset => set)
+  #
+  # RUnshare.unshare(:persist => "web", ...) binds the namespaces it
+  # creates into an entry as well.
+  module Registry
+    @dir = "/run/runshare".freeze
+
+    class << self
+      attr_accessor :dir
+
+      def path(name)
+        name = name.to_s
+        if name.empty? || name.include?("/") || name.start_with?(".")
+          raise ArgumentError, "invalid registry name: #{name.inspect}"
+        end
+        File.join(dir, name)
+      end
+
+      # Creates the entry directory of name, replacing a stale one.
+      def entry(name, owner = Process.pid)
+        entry = path(name)
+        mount_private(dir)
+        remove(name) if File.directory?(entry) && !alive?(name)
+        Dir.mkdir(entry, 0755)
+        File.write(File.join(entry, "owner"), "#{owner} #{start_time(owner)}\n")
+        entry
+      end
+
+      # Binds the namespaces of set (see NamespaceSet) under name.
+      def register(name, set, owner = Process.pid)
+        entry = entry(name, owner)
+        begin
+          set.persist(entry)
+        rescue SystemCallError
+          remove(name)
+          raise
+        end
+        entry
+      end
+
+      # Opens the namespaces of name as a NamespaceSet.
+      def open(name)
+        NamespaceSet.open(path(name))
+      end
+
+      def names
+        Dir.children(dir).select { |name| File.directory?(File.join(dir, name)) }
+      rescue Errno::ENOENT
+        []
+      end
+
+      def include?(name)
+        File.directory?(path(name))
+      end
+
+      # [pid, start time] of the owner of name
+      def owner(name)
+        pid, start = File.read(File.join(path(name), "owner")).split.map(&:to_i)
+        [pid, start]
+      rescue Errno::ENOENT
+        nil
+      end
+
+      def remove(name)
+        entry = path(name)
+        umount(entry)
+        Dir.children(entry).each { |file| File.unlink(File.join(entry, file)) }
+        Dir.rmdir(entry)
+      rescue Errno::ENOENT
+        nil
+      end
+
+      # Start time of pid in clock ticks after boot, nil once it is gone.
+      # Field 22 of /proc/<pid>/stat, counted after the command name.
+      def start_time(pid)
+        File.read("/proc/#{pid}/stat").split(") ", 2).last.split[19].to_i
+      rescue Errno::ENOENT, Errno::ESRCH
+        nil
+      end
+
+      # Removes the entries of owners that have exited, returns their names.
+      def gc
+        names.reject { |name| alive?(name) }.each { |name| remove(name) }
+      end
+
+      private
+
+      # the owner is compared by start time too, its pid may be reused
+      def alive?(name)
+        pid, start = owner(name)
+        !start.nil? && start_time(pid) == start
+      end
+    end
+  end
+end
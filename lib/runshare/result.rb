@@ -0,0 +1,99 @@
+module RUnshare
+  # The exit of a sandbox reaped by Child#wait, with the resources it
+  # used as wait4(2) reports them: CPU times, peak memory, page faults
+  # and context switches. They cover the sandbox and the processes it
+  # reaped itself, e.g. everything in a pid namespace it was init of.
+  # maxrss of a spawned sandbox is at least the RSS of the ruby process:
+  # the kernel keeps the peak of the memory it shared until execve.
+  #
+  # It answers the Process::Status queries, so it can stand in for one:
+  #
+  #   res = RUnshare.spawn(["/bin/sh", "-c", "exit 3"]).wait
+  #   res.exitstatus # => 3
+  #   res.utime      # => 0.0012 (seconds)
+  #   res.maxrss     # => 3395584 (bytes)
+  class Result
+    attr_reader :status, :utime, :stime, :maxrss, :minflt, :majflt, :nvcsw, :nivcsw
+
+    def initialize(status, utime, stime, maxrss, minflt, majflt, nvcsw, nivcsw)
+      @status = status
+      @utime = utime
+      @stime = stime
+      @maxrss = maxrss
+      @minflt = minflt
+      @majflt = majflt
+      @nvcsw = nvcsw
+      @nivcsw = nivcsw
+      freeze
+    end
+
+    # the Process::Status queries, plain methods so that other Ractors can call them
+    def pid
+      @status.pid
+    end
+
+    def exitstatus
+      @status.exitstatus
+    end
+
+    def termsig
+      @status.termsig
+    end
+
+    def stopsig
+      @status.stopsig
+    end
+
+    def success?
+      @status.success?
+    end
+
+    def exited?
+      @status.exited?
+    end
+
+    def signaled?
+      @status.signaled?
+    end
+
+    def stopped?
+      @status.stopped?
+    end
+
+    def coredump?
+      @status.coredump?
+    end
+
+    def to_i
+      @status.to_i
+    end
+
+    alias exit_code exitstatus
+    alias signal termsig
+
+    def ==(other)
+      other.is_a?(Result) ? @status == other.status : @status == other
+    end
+
+    # seconds of CPU in user and kernel mode
+    def cpu_time
+      @utime + @stime
+    end
+
+    # voluntary and involuntary context switches
+    def context_switches
+      @nvcsw + @nivcsw
+    end
+
+    def to_h
+      { pid: pid, exit_code: exitstatus, signal: termsig, coredump: coredump?,
+        utime: @utime, stime: @stime, maxrss: @maxrss, minflt: @minflt, majflt: @majflt,
+        nvcsw: @nvcsw, nivcsw: @nivcsw }
+    end
+
+    def inspect
+      "#<#{self.class.name} #{@status.inspect.sub(/\A#<Process::Status: (.*)>\z/, '\1')} " \
+        "utime=#{@utime} stime=#{@stime} maxrss=#{@maxrss}>"
+    end
+  end
+end
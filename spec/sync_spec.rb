@@ -0,0 +1,35 @@
+RSpec.describe "parent/child handoffs" do
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  # The handoffs used to back off for 250 ms on EINTR (all-io.h), so a
+  # signal flood during setup has to leave the tail latency untouched.
+  it "keeps spawn latency low while signals are injected" do
+    zygote = RUnshare::Zygote.new
+    old = trap("USR1") {}
+    # ruby runs a handler for SIGUSR1; the zygote has no signal handler
+    # to interrupt, it reaps with wait4 when the parent asks (ZYGOTE_REAP)
+    killer = Process.spawn("sh", "-c", "while kill -USR1 #{Process.pid}; do :; done")
+
+    latencies = Array.new(500) do
+      start = now
+      child = zygote.spawn(["/bin/true"])
+      elapsed = now - start
+      child.wait
+      elapsed
+    end
+
+    # a spawn costs ~1 ms on a busy single CPU, a single back-off 250 ms
+    latencies.sort!
+    expect(latencies[(latencies.size * 0.99).ceil - 1]).to be < 0.025
+    expect(latencies.last).to be < 0.25
+  ensure
+    if killer
+      Process.kill(:KILL, killer)
+      Process.wait(killer)
+    end
+    trap("USR1", old) if old
+    zygote.close if zygote
+  end
+end
@@ -0,0 +1,22 @@
+# rake compile && sudo ruby -I ./lib ./test/test6.rb
+
+require "runshare"
+
+puts Process.pid
+
+server = RUnshare::ForkServer.new(
+  File.expand_path("test6_jobs.rb", __dir__),
+  :clone_newpid => true,
+  :clone_newuts => true,
+  :mount_proc   => "/proc"
+)
+puts "- server=#{server.pid}"
+
+jobs = (1..3).map { |n| server.run(n) }
+puts "-- jobs=#{jobs}"
+
+jobs.each { |pid| puts "-- #{pid} exit=#{server.wait(pid)}" }
+
+server.close
+
+puts 'done'
@@ -0,0 +1,6 @@
+# preload of test6.rb
+
+RUnshare::ForkServer.job do |n|
+  puts "--- job #{n}, pid=#{Process.pid}, host=#{File.read("/proc/sys/kernel/hostname").strip}"
+  exit(n)
+end
@@ -0,0 +1,34 @@
+# rake compile && sudo ruby -I ./lib ./test/test7.rb [spawns per ractor]
+#
+# Spawn throughput with 1..nproc Ractors, each starting sandboxes on
+# its own. Shows how creation scales across cores.
+
+require "etc"
+require "runshare"
+
+Warning[:experimental] = false
+
+count = (ARGV[0] || 200).to_i
+spec = Ractor.make_shareable(RUnshare::Spec.new(:clone_newuts => true, :clone_newipc => true))
+cmd = Ractor.make_shareable(["/bin/true"])
+
+workers = [1, 2, 4, 8, Etc.nprocessors].uniq.select { |n| n <= Etc.nprocessors }
+base = nil
+
+workers.each do |n|
+  t = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+  ractors = n.times.map do
+    Ractor.new(spec, cmd, count) do |spec, cmd, count|
+      count.times { spec.spawn(cmd).wait }
+      count
+    end
+  end
+  total = ractors.sum(&:take)
+
+  rate = total / (Process.clock_gettime(Process::CLOCK_MONOTONIC) - t)
+  base ||= rate
+  puts format("ractors=%-3d spawns/s=%8.0f speedup=%.2f", n, rate, rate / base)
+end
+
+puts 'done'